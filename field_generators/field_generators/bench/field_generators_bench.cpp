@@ -0,0 +1,337 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+
+#include <boost/filesystem.hpp>
+
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include "common.h"
+#include "mesh_model.h"
+#include "point_cloud.h"
+#include "dense_field.h"
+#include "triangle_bvh.h"
+
+DEFINE_string(bench_shapes, "sphere,torus,blob", "Procedural meshes to run on: sphere, torus, and blob (a sphere with bumps and per vertex noise)");
+DEFINE_string(bench_faces, "1000,10000,100000,1000000,5000000", "Approximate face numbers of the procedural meshes");
+DEFINE_string(bench_resolutions, "32,64,128,256", "Field resolutions");
+DEFINE_int32(bench_repeats, 5, "Timed runs per measurement after one warm-up run, of which the median, minimum and maximum are reported");
+DEFINE_int32(bench_thread_num, 0, "Number of threads of the field builds, 0 for all hardware threads");
+DEFINE_double(bench_truncation, 0.0, "Distance field truncation distance in voxels, 0 for no truncation");
+DEFINE_bool(bench_signed, false, "Also time signed mesh fields, with the sign from generalized winding numbers");
+DEFINE_bool(bench_scan, false, "Also time the OpenGL virtual scan, which is skipped where no offscreen context can be created");
+DEFINE_double(bench_scan_gain, 0.01, "Least fraction of new surface of a view of the adaptive scan");
+DEFINE_int32(bench_surface_points, 100000, "Number of points of the surface sampling");
+DEFINE_string(bench_csv, "", "Also save the results into this .csv file");
+DEFINE_string(bench_folder, "", "Folder for the HDF5 files written while timing, the system temporary folder if empty");
+
+namespace {
+  struct Mesh {
+    std::vector<Eigen::Vector3f> vertices;
+    std::vector<Eigen::Vector3i> triangles;
+  };
+
+  struct Result {
+    std::string shape;
+    int face_num;
+    std::string stage;
+    int resolution;
+    double median_ms;
+    double min_ms;
+    double max_ms;
+  };
+
+  std::vector<std::string> splitList(const std::string& text) {
+    std::vector<std::string> tokens;
+    std::stringstream stream(text);
+    std::string token;
+    while (std::getline(stream, token, ','))
+      if (!token.empty())
+        tokens.push_back(token);
+    return tokens;
+  }
+
+  // Rings of latitude between two poles, with radius(theta, phi) the distance of
+  // the surface from the center, about face_num faces in total.
+  void makeSphere(int face_num, const std::function<float(float, float)>& radius, Mesh& mesh) {
+    int ring_num = std::max(int(std::sqrt(face_num/4.0)+0.5), 2);
+    int segment_num = 2*ring_num;
+    mesh.vertices.clear();
+    mesh.triangles.clear();
+
+    mesh.vertices.push_back(Eigen::Vector3f(0.0f, radius(0.0f, 0.0f), 0.0f));
+    for (int i = 1; i < ring_num; ++ i) {
+      float theta = float(M_PI)*i/ring_num;
+      for (int j = 0; j < segment_num; ++ j) {
+        float phi = 2*float(M_PI)*j/segment_num;
+        float r = radius(theta, phi);
+        mesh.vertices.push_back(Eigen::Vector3f(r*std::sin(theta)*std::cos(phi), r*std::cos(theta), r*std::sin(theta)*std::sin(phi)));
+      }
+    }
+    mesh.vertices.push_back(Eigen::Vector3f(0.0f, -radius(float(M_PI), 0.0f), 0.0f));
+
+    int south = int(mesh.vertices.size())-1;
+    auto ringVertex = [segment_num](int ring, int segment) {return 1+(ring-1)*segment_num+segment%segment_num;};
+    for (int j = 0; j < segment_num; ++ j) {
+      mesh.triangles.push_back(Eigen::Vector3i(0, ringVertex(1, j+1), ringVertex(1, j)));
+      mesh.triangles.push_back(Eigen::Vector3i(south, ringVertex(ring_num-1, j), ringVertex(ring_num-1, j+1)));
+    }
+    for (int i = 1; i+1 < ring_num; ++ i) {
+      for (int j = 0; j < segment_num; ++ j) {
+        mesh.triangles.push_back(Eigen::Vector3i(ringVertex(i, j), ringVertex(i, j+1), ringVertex(i+1, j+1)));
+        mesh.triangles.push_back(Eigen::Vector3i(ringVertex(i, j), ringVertex(i+1, j+1), ringVertex(i+1, j)));
+      }
+    }
+
+    return;
+  }
+
+  void makeTorus(int face_num, Mesh& mesh) {
+    int minor_num = std::max(int(std::sqrt(face_num/4.0)+0.5), 3);
+    int major_num = 2*minor_num;
+    const float major_radius = 1.0f, minor_radius = 0.35f;
+    mesh.vertices.clear();
+    mesh.triangles.clear();
+
+    for (int i = 0; i < major_num; ++ i) {
+      float u = 2*float(M_PI)*i/major_num;
+      for (int j = 0; j < minor_num; ++ j) {
+        float v = 2*float(M_PI)*j/minor_num;
+        float r = major_radius+minor_radius*std::cos(v);
+        mesh.vertices.push_back(Eigen::Vector3f(r*std::cos(u), minor_radius*std::sin(v), r*std::sin(u)));
+      }
+    }
+    for (int i = 0; i < major_num; ++ i) {
+      for (int j = 0; j < minor_num; ++ j) {
+        int a = i*minor_num+j, b = ((i+1)%major_num)*minor_num+j;
+        int c = ((i+1)%major_num)*minor_num+(j+1)%minor_num, d = i*minor_num+(j+1)%minor_num;
+        mesh.triangles.push_back(Eigen::Vector3i(a, d, c));
+        mesh.triangles.push_back(Eigen::Vector3i(a, c, b));
+      }
+    }
+
+    return;
+  }
+
+  bool makeMesh(const std::string& shape, int face_num, Mesh& mesh) {
+    if (shape == "sphere") {
+      makeSphere(face_num, [](float, float) {return 1.0f;}, mesh);
+    } else if (shape == "torus") {
+      makeTorus(face_num, mesh);
+    } else if (shape == "blob") {
+      // Seeded, so that every run times the very same mesh.
+      std::mt19937 generator(20170601);
+      std::uniform_real_distribution<float> jitter(-0.01f, 0.01f);
+      makeSphere(face_num, [&generator, &jitter](float theta, float phi) {
+        return 1.0f+0.15f*std::sin(3*theta)*std::cos(4*phi)+0.1f*std::sin(5*phi+2*theta)+jitter(generator);
+      }, mesh);
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  // The mesh vertices, with area weighted normals, stand in for scanned points.
+  void makePoints(const Mesh& mesh, PclPointCloud::Ptr points) {
+    std::vector<Eigen::Vector3f> normals(mesh.vertices.size(), Eigen::Vector3f::Zero());
+    for (size_t i = 0, i_end = mesh.triangles.size(); i < i_end; ++ i) {
+      const Eigen::Vector3i& t = mesh.triangles[i];
+      Eigen::Vector3f normal = (mesh.vertices[t[1]]-mesh.vertices[t[0]]).cross(mesh.vertices[t[2]]-mesh.vertices[t[0]]);
+      for (int j = 0; j < 3; ++ j)
+        normals[t[j]] += normal;
+    }
+
+    points->clear();
+    points->reserve(mesh.vertices.size());
+    for (size_t i = 0, i_end = mesh.vertices.size(); i < i_end; ++ i) {
+      PclPoint point;
+      point.x = mesh.vertices[i].x();
+      point.y = mesh.vertices[i].y();
+      point.z = mesh.vertices[i].z();
+      Eigen::Vector3f normal = normals[i].normalized();
+      point.normal_x = normal.x();
+      point.normal_y = normal.y();
+      point.normal_z = normal.z();
+      points->push_back(point);
+    }
+
+    return;
+  }
+
+  // One warm-up run, then the timed ones; setup runs before each, untimed.
+  Result measure(const std::string& shape, int face_num, const std::string& stage, int resolution, const std::function<void(void)>& run,
+      const std::function<void(void)>& setup = std::function<void(void)>()) {
+    std::vector<double> times;
+    for (int r = 0, r_end = std::max(FLAGS_bench_repeats, 1); r <= r_end; ++ r) {
+      if (setup)
+        setup();
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      run();
+      std::chrono::duration<double, std::milli> duration = std::chrono::steady_clock::now()-start;
+      if (r != 0)
+        times.push_back(duration.count());
+    }
+    std::sort(times.begin(), times.end());
+
+    Result result;
+    result.shape = shape;
+    result.face_num = face_num;
+    result.stage = stage;
+    result.resolution = resolution;
+    result.median_ms = times[times.size()/2];
+    result.min_ms = times.front();
+    result.max_ms = times.back();
+
+    std::printf("%-8s %10d %-20s %6s %12.3f %12.3f %12.3f\n", shape.c_str(), face_num, stage.c_str(),
+        (resolution > 0) ? std::to_string(resolution).c_str() : "-", result.median_ms, result.min_ms, result.max_ms);
+    std::fflush(stdout);
+    return result;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  google::SetUsageMessage("Times the stages of distance field generation on procedural meshes, with no GPU needed.");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  ::google::InitGoogleLogging("FieldGeneratorsBench");
+
+  int thread_num = (FLAGS_bench_thread_num > 0) ? FLAGS_bench_thread_num : std::max(int(std::thread::hardware_concurrency()), 1);
+  boost::filesystem::path folder = FLAGS_bench_folder.empty() ? boost::filesystem::temp_directory_path() : FLAGS_bench_folder;
+  std::string filename_h5 = (folder/boost::filesystem::unique_path("field_generators_bench_%%%%%%%%.h5")).string();
+
+  std::vector<int> face_nums, resolutions;
+  std::vector<std::string> tokens = splitList(FLAGS_bench_faces);
+  for (size_t i = 0, i_end = tokens.size(); i < i_end; ++ i)
+    face_nums.push_back(std::atoi(tokens[i].c_str()));
+  tokens = splitList(FLAGS_bench_resolutions);
+  for (size_t i = 0, i_end = tokens.size(); i < i_end; ++ i)
+    resolutions.push_back(std::atoi(tokens[i].c_str()));
+
+  std::printf("%d threads, %d repeats after one warm-up run, times in ms\n", thread_num, std::max(FLAGS_bench_repeats, 1));
+  std::printf("%-8s %10s %-20s %6s %12s %12s %12s\n", "shape", "faces", "stage", "res", "median", "min", "max");
+
+  std::vector<Result> results;
+  std::vector<std::string> shapes = splitList(FLAGS_bench_shapes);
+  for (size_t s = 0, s_end = shapes.size(); s < s_end; ++ s) {
+    for (size_t f = 0, f_end = face_nums.size(); f < f_end; ++ f) {
+      Mesh mesh;
+      if (!makeMesh(shapes[s], face_nums[f], mesh)) {
+        LOG(ERROR) << "Unknown shape " << shapes[s] << "!" << std::endl;
+        break;
+      }
+      const std::string& shape = shapes[s];
+      int face_num = int(mesh.triangles.size());
+
+      osg::ref_ptr<MeshModel> mesh_model(new MeshModel);
+      mesh_model->setTriangles(mesh.vertices, mesh.triangles);
+      PclPointCloud::Ptr points(new PclPointCloud);
+      makePoints(mesh, points);
+
+      TriangleBVH bvh;
+      results.push_back(measure(shape, face_num, "bvh_build", 0, [&]() {bvh.build(mesh.vertices, mesh.triangles);}));
+
+      PclPointCloud::Ptr ray_cast_scan(new PclPointCloud);
+      results.push_back(measure(shape, face_num, "ray_cast_scan", 0, [&]() {
+        mesh_model->sampleScan(ray_cast_scan, 100, 0.0, ScanEngine::RAY_CAST, thread_num);
+      }));
+      int view_num = 0;
+      results.push_back(measure(shape, face_num, "adaptive_ray_cast_scan", 0, [&]() {
+        mesh_model->sampleScanAdaptive(ray_cast_scan, 100, 0.0, FLAGS_bench_scan_gain, 0, &view_num, ScanEngine::RAY_CAST, thread_num);
+      }));
+      LOG(INFO) << "Adaptive scan of " << shape << " with " << face_num << " faces took " << view_num << " views!" << std::endl;
+      PclPointCloud::Ptr surface_points(new PclPointCloud);
+      results.push_back(measure(shape, face_num, "surface_sample", 0, [&]() {
+        mesh_model->sampleSurface(surface_points, FLAGS_bench_surface_points, 0.0, thread_num);
+      }));
+      results.push_back(measure(shape, face_num, "surface_sample_thinned", 0, [&]() {
+        mesh_model->sampleSurface(surface_points, FLAGS_bench_surface_points, 0.7, thread_num);
+      }));
+
+      if (FLAGS_bench_scan) {
+        PclPointCloud::Ptr scan(new PclPointCloud);
+        if (mesh_model->sampleScan(scan, 100, 0.0) > 0.0) {
+          results.push_back(measure(shape, face_num, "scan", 0, [&]() {mesh_model->sampleScan(scan, 100, 0.0);}));
+          results.push_back(measure(shape, face_num, "tiled_scan", 0, [&]() {
+            mesh_model->sampleScan(scan, 100, 0.0, ScanEngine::OPENGL_TILED, thread_num);
+          }));
+          results.push_back(measure(shape, face_num, "async_scan", 0, [&]() {
+            mesh_model->sampleScan(scan, 100, 0.0, ScanEngine::OPENGL_ASYNC, thread_num);
+          }));
+        } else {
+          LOG(WARNING) << "No offscreen context, skipping the virtual scan!" << std::endl;
+        }
+      }
+
+      for (size_t r = 0, r_end = resolutions.size(); r < r_end; ++ r) {
+        int resolution = resolutions[r];
+        osg::ref_ptr<DenseField> distance_field(new DenseField(resolution));
+        results.push_back(measure(shape, face_num, "mesh_field", resolution, [&]() {
+          mesh_model->buildDistanceField(distance_field, FLAGS_bench_truncation, thread_num);
+        }));
+        if (FLAGS_bench_signed) {
+          osg::ref_ptr<DenseField> signed_field(new DenseField(resolution));
+          results.push_back(measure(shape, face_num, "mesh_signed_field", resolution, [&]() {
+            mesh_model->buildDistanceField(signed_field, FLAGS_bench_truncation, thread_num, true);
+          }));
+        }
+
+        // As the batch generation does for scans, at half the voxel size.
+        osg::ref_ptr<PointCloud> filtered(new PointCloud);
+        double grid_size = distance_field->getStep()/2;
+        results.push_back(measure(shape, face_num, "voxel_filter", resolution, [&]() {filtered->voxelGridFilter(grid_size, true);},
+            [&]() {
+              *(filtered->data()) = *points;
+              filtered->buildTree();
+            }));
+
+        osg::ref_ptr<PointCloud> point_cloud(new PointCloud);
+        *(point_cloud->data()) = *points;
+        osg::ref_ptr<DenseField> point_field(new DenseField(resolution));
+        results.push_back(measure(shape, face_num, "kdtree_field", resolution, [&]() {
+          point_cloud->buildDistanceField(point_field, DistanceFieldEngine::KD_TREE, FLAGS_bench_truncation, thread_num);
+        }));
+        results.push_back(measure(shape, face_num, "edt_field", resolution, [&]() {
+          point_cloud->buildDistanceField(point_field, DistanceFieldEngine::EDT, FLAGS_bench_truncation, thread_num);
+        }));
+
+        const FieldCompression compressions[2] = {FieldCompression::NONE, FieldCompression::DEFLATE};
+        const char* suffixes[2] = {"", "_deflate"};
+        for (int c = 0; c < 2; ++ c) {
+          distance_field->setCompression(compressions[c]);
+          results.push_back(measure(shape, face_num, std::string("hdf5_write")+suffixes[c], resolution, [&]() {
+            distance_field->save(filename_h5);
+          }));
+          osg::ref_ptr<DenseField> loaded_field(new DenseField);
+          results.push_back(measure(shape, face_num, std::string("hdf5_read")+suffixes[c], resolution, [&]() {
+            loaded_field->load(filename_h5);
+          }));
+        }
+      }
+    }
+  }
+  boost::system::error_code error;
+  boost::filesystem::remove(filename_h5, error);
+
+  if (!FLAGS_bench_csv.empty()) {
+    std::ofstream fout(FLAGS_bench_csv);
+    fout << "shape,faces,stage,resolution,median_ms,min_ms,max_ms\n";
+    for (size_t i = 0, i_end = results.size(); i < i_end; ++ i) {
+      const Result& result = results[i];
+      fout << result.shape << "," << result.face_num << "," << result.stage << "," << result.resolution << ","
+          << result.median_ms << "," << result.min_ms << "," << result.max_ms << "\n";
+    }
+  }
+
+  return 0;
+}
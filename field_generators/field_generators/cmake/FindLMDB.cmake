@@ -0,0 +1,31 @@
+# - Try to find LMDB
+#
+# The following variables are optionally searched for defaults
+#  LMDB_ROOT_DIR:            Base directory where all LMDB components are found
+#
+# The following are set after configuration is done:
+#  LMDB_FOUND
+#  LMDB_INCLUDE_DIRS
+#  LMDB_LIBRARIES
+
+include(FindPackageHandleStandardArgs)
+
+set(LMDB_ROOT_DIR "" CACHE PATH "Folder contains LMDB")
+
+find_path(LMDB_INCLUDE_DIR lmdb.h
+    PATHS ${LMDB_ROOT_DIR} $ENV{LMDB_DIR}
+    PATH_SUFFIXES include)
+
+find_library(LMDB_LIBRARY lmdb
+    PATHS ${LMDB_ROOT_DIR} $ENV{LMDB_DIR}
+    PATH_SUFFIXES
+        lib
+        lib64)
+
+find_package_handle_standard_args(LMDB DEFAULT_MSG
+    LMDB_INCLUDE_DIR LMDB_LIBRARY)
+
+if(LMDB_FOUND)
+    set(LMDB_INCLUDE_DIRS ${LMDB_INCLUDE_DIR})
+    set(LMDB_LIBRARIES ${LMDB_LIBRARY})
+endif()
@@ -0,0 +1,65 @@
+#pragma once
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <deque>
+#include <mutex>
+#include <algorithm>
+#include <condition_variable>
+
+// Blocking FIFO of limited capacity between the stages of a pipeline. Producers
+// block while it is full and consumers while it is empty. Each of the producers
+// calls close() when it is done, after the last one pop() returns false once
+// the queue is drained, so that the consumers know to quit.
+template <typename T>
+class BoundedQueue {
+public:
+  BoundedQueue(size_t capacity, int producer_num = 1) :
+      capacity_(std::max(capacity, size_t(1))), producer_num_(producer_num) {
+  }
+
+  bool push(T&& item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this]() {return queue_.size() < capacity_ || producer_num_ <= 0;});
+    if (producer_num_ <= 0)
+      return false;
+    queue_.push_back(std::move(item));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this]() {return !queue_.empty() || producer_num_ <= 0;});
+    if (queue_.empty())
+      return false;
+    item = std::move(queue_.front());
+    queue_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void close(void) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (-- producer_num_ <= 0) {
+      not_empty_.notify_all();
+      not_full_.notify_all();
+    }
+    return;
+  }
+
+  size_t size(void) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queue_.size();
+  }
+
+protected:
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::deque<T> queue_;
+  size_t capacity_;
+  int producer_num_;
+};
+
+#endif // BOUNDED_QUEUE_H
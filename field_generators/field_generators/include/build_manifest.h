@@ -0,0 +1,66 @@
+#pragma once
+#ifndef BUILD_MANIFEST_H
+#define BUILD_MANIFEST_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <fstream>
+#include <cstdint>
+
+// Record of what the batch generation produced: per output, the stamp of its
+// source, a hash of the parameters it was generated with, and the size, time
+// and checksum of the output file. Outputs whose record still matches are up
+// to date, and need neither be generated again nor be read to find that out.
+//
+// Records are appended to the manifest file as they are made, so that what was
+// done before a crash is kept; later records override earlier ones, and close()
+// rewrites the file with one record per output.
+class BuildManifest {
+public:
+  BuildManifest(void);
+  virtual ~BuildManifest(void);
+
+  // Source stamps are file size and modification time, or a content hash with
+  // hash_sources. With verify_outputs, outputs are checksummed again when checked.
+  bool open(const std::string& filename, bool hash_sources = false, bool verify_outputs = false);
+
+  // Thread safe.
+  bool isUpToDate(const std::string& output, const std::string& source, const std::string& parameters);
+  bool record(const std::string& output, const std::string& source, const std::string& parameters);
+
+  bool close(void);
+
+  int getSkippedNum(void) const {
+    return skipped_num_;
+  }
+
+  // 64 bit FNV-1a, in hex.
+  static std::string hashString(const std::string& text);
+  static bool hashFile(const std::string& filename, std::string& hash);
+
+protected:
+  struct Entry {
+    std::string source_stamp;
+    std::string parameters_hash;
+    uintmax_t output_size;
+    int64_t output_time;
+    std::string output_checksum;
+  };
+
+  bool stampSource(const std::string& source, std::string& stamp);
+  static void writeEntry(std::ostream& out, const std::string& output, const Entry& entry);
+
+protected:
+  std::string filename_;
+  bool hash_sources_;
+  bool verify_outputs_;
+
+  std::mutex mutex_;
+  std::map<std::string, Entry> entries_;
+  std::map<std::string, std::string> source_stamps_;
+  std::ofstream journal_;
+  int skipped_num_;
+};
+
+#endif // BUILD_MANIFEST_H
@@ -5,6 +5,7 @@
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <string>
+#include <functional>
 #include <osg/Vec3>
 #include <cgal_types.h>
 
@@ -12,6 +13,22 @@ enum class PointCloudColorMode {
   ORIGINAL, UNIFORM
 };
 
+enum class DistanceFieldEngine {
+  KD_TREE, EDT
+};
+
+enum class ScanEngine {
+  OPENGL, OPENGL_TILED, OPENGL_ASYNC, RAY_CAST
+};
+
+enum class FieldQuantization {
+  FLOAT32, FLOAT16, UINT8
+};
+
+enum class FieldCompression {
+  NONE, DEFLATE, LZF, SZIP
+};
+
 enum class PickMode {
   CTRL, SHIFT, ALT, UNKNOWN
 };
@@ -19,6 +36,9 @@ enum class PickMode {
 namespace Common {
 std::string int2String(int i, int width);
 void randomK(std::vector<int>& random_k, int k, int N);
+// Run func(item, thread_idx) for item in [0, item_num) on thread_num threads that pull
+// items from a shared cursor; thread_idx can be used to address per-thread buffers.
+void parallelFor(int item_num, int thread_num, const std::function<void(int, int)>& func);
 }
 
 #endif // COMMON_H_
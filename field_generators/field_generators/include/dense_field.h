@@ -2,9 +2,13 @@
 #ifndef DENSE_FIELD_H
 #define DENSE_FIELD_H
 
+#include <vector>
+
 #include "renderable.h"
 
-class OSGViewerWidget;
+namespace H5 {
+class DSetCreatPropList;
+}
 
 class DenseField: public Renderable {
 
@@ -38,6 +42,9 @@ public:
     z_min_ = z_min;
   }
 
+  // Center a cube padded by padding_scale around the bounding box, and set the step accordingly.
+  void fitBoundingBox(double x_min, double y_min, double z_min, double x_max, double y_max, double z_max, double padding_scale = 1.25);
+
   const float& at(int x, int y, int z) const {
     return data_[index(x, y, z)];
   }
@@ -45,8 +52,84 @@ public:
     return data_[index(x, y, z)];
   }
 
-  bool load(const std::string& filename, OSGViewerWidget* osg_viewer_widget = nullptr);
-  bool save(const std::string& filename);
+  float* data(void) {
+    return data_;
+  }
+  const float* data(void) const {
+    return data_;
+  }
+
+  // The field stays unsigned; an optional inside mask carries the sign, and is
+  // saved as an extra SignedDenseField dataset.
+  bool isSigned(void) const {
+    return !inside_.empty();
+  }
+  void setSigned(bool with_sign) {
+    inside_.assign(with_sign ? resolution_ * resolution_ * resolution_ : 0, 0);
+  }
+  const char& insideAt(int x, int y, int z) const {
+    return inside_[index(x, y, z)];
+  }
+  char& insideAt(int x, int y, int z) {
+    return inside_[index(x, y, z)];
+  }
+  float signedAt(int x, int y, int z) const {
+    int idx = index(x, y, z);
+    return (!inside_.empty() && inside_[idx]) ? -data_[idx] : data_[idx];
+  }
+
+  // Optional unit normal of the nearest surface point of every voxel, zero where
+  // the distance is clamped, saved as an extra 3-channel NormalField dataset.
+  bool hasNormals(void) const {
+    return !normals_.empty();
+  }
+  void setWithNormals(bool with_normals) {
+    normals_.assign(with_normals ? 3 * resolution_ * resolution_ * resolution_ : 0, 0.0f);
+  }
+  const float* normalAt(int x, int y, int z) const {
+    return &normals_[3 * index(x, y, z)];
+  }
+  float* normalAt(int x, int y, int z) {
+    return &normals_[3 * index(x, y, z)];
+  }
+
+  // How the values are stored on save. FLOAT16 halves the size, UINT8 maps
+  // [0, truncation] (or [-truncation, truncation] for the signed values) onto
+  // 0..255; without a positive truncation the largest value is used instead.
+  // Meta[4..5] and Meta[6..7] hold the scale and offset that map stored values
+  // back for the unsigned and the signed dataset, and load dequantizes them.
+  FieldQuantization getQuantization(void) const {
+    return quantization_;
+  }
+  void setQuantization(FieldQuantization quantization, float truncation = 0.0f) {
+    quantization_ = quantization;
+    quantization_truncation_ = truncation;
+  }
+  // The unsigned values in [0, range] map onto 0..255 with UINT8.
+  float getQuantizationRange(void) const;
+
+  // Datasets are written in chunk_size^3 chunks through the given filter, with
+  // byte shuffling ahead of DEFLATE and LZF. LZF and SZIP are used only when the
+  // HDF5 library provides them, DEFLATE otherwise. Reading needs no settings.
+  void setCompression(FieldCompression compression, int level = 4, int chunk_size = 32) {
+    compression_ = compression;
+    compression_level_ = level;
+    chunk_size_ = chunk_size;
+  }
+  static bool isCompressionAvailable(FieldCompression compression);
+  // The filter of compression on a chunked property list, shared with FieldArchive.
+  static void setCompressionFilter(H5::DSetCreatPropList& property_list, FieldCompression compression, int level);
+
+  // Size of all the datasets as plain float32, for reporting compression ratios.
+  size_t getUncompressedSize(void) const;
+
+  // A file may hold a pyramid of levels: the primary one under DenseField/Meta,
+  // coarser ones under DenseField_<R>/Meta_<R>. A non-zero level picks one of
+  // those on load, and append adds this field as such a level to an existing file.
+  bool load(const std::string& filename, int level = 0);
+  bool save(const std::string& filename, bool append = false);
+
+  bool computeDeviation(const DenseField* reference, double& max_deviation, double& mean_deviation) const;
 
 protected:
   virtual void updateImpl(void);
@@ -58,14 +141,24 @@ protected:
   int resolution_;
   float *data_;
 
+  std::vector<char> inside_;
+  std::vector<float> normals_;
+
+  FieldQuantization quantization_;
+  float quantization_truncation_;
+
+  FieldCompression compression_;
+  int compression_level_;
+  int chunk_size_;
+
   double step_;
   double x_min_;
   double y_min_;
   double z_min_;
 
 private:
-  bool readHdf5File(const std::string& filename);
-  bool saveHdf5File(const std::string& filename);
+  bool readHdf5File(const std::string& filename, const std::string& suffix);
+  bool saveHdf5File(const std::string& filename, const std::string& suffix);
 };
 
 #endif // DENSE_FIELD_H
@@ -0,0 +1,40 @@
+#pragma once
+#ifndef DISTANCE_TRANSFORM_H
+#define DISTANCE_TRANSFORM_H
+
+#include <vector>
+
+#include <Eigen/Core>
+
+// Separable exact Euclidean distance transform (Felzenszwalb & Huttenlocher) on a
+// resolution^3 grid, laid out the same way as DenseField, i.e. (x*R+y)*R+z.
+class DistanceTransform {
+public:
+  // Squared distance transform of f along one line of n samples, also recording
+  // for every sample the index of the parabola that realizes the minimum.
+  static void transform1D(const float* f, int n, float* d, int* arg, int* v, double* z);
+
+  // Squared distance (in voxel units) from every voxel center to the nearest
+  // occupied cell center, and the index of that cell, or -1 if there is none.
+  static void computeSquared(const std::vector<char>& occupied, int resolution, std::vector<float>& squared_distances,
+      std::vector<int>& nearest_cells, int thread_num = 1);
+
+  // Mark the cells that contain at least one seed, seeds in continuous voxel coordinates.
+  static void rasterize(const std::vector<Eigen::Vector3f>& seeds, int resolution, std::vector<char>& occupied);
+
+  // Grow the marked cells by radius cells along each axis (box dilation), one pass per axis.
+  static void dilate(std::vector<char>& mask, int resolution, int radius);
+
+  // Distance (in voxel units) from every voxel center to the nearest seed, with
+  // seeds given in continuous voxel coordinates. The grid transform picks the
+  // candidate cells, then the actual seed positions in the 3x3x3 neighbourhood
+  // of each voxel are evaluated to recover the sub-voxel offsets. With a positive
+  // truncation, distances are clamped to it and voxels that are provably beyond
+  // it skip the refinement. Both the axis passes and the refinement are split
+  // across thread_num threads. If nearest_seeds is given, it receives the index of
+  // the nearest seed of every voxel, or -1 where the distance was clamped.
+  static void compute(const std::vector<Eigen::Vector3f>& seeds, int resolution, float* field, float truncation = 0.0f, int thread_num = 1,
+      int* nearest_seeds = nullptr);
+};
+
+#endif // DISTANCE_TRANSFORM_H
@@ -0,0 +1,69 @@
+#pragma once
+#ifndef FIELD_ARCHIVE_H
+#define FIELD_ARCHIVE_H
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+#include "common.h"
+
+class DenseField;
+
+// Many fields packed into one HDF5 file: an N*R*R*R DenseField dataset with an
+// N*256 Meta dataset per resolution (suffixed with _<R> except for the first,
+// as in single field files), SignedDenseField datasets for signed fields, and
+// an index of Names and Labels, row i describing the i-th field.
+//
+// Fields are queued by any number of threads and written by a single writer
+// thread, the only one that touches the HDF5 library.
+class FieldArchive {
+public:
+  FieldArchive(void);
+  virtual ~FieldArchive(void);
+
+  bool open(const std::string& filename, const std::vector<int>& resolutions, bool with_sign = false,
+      FieldCompression compression = FieldCompression::NONE, int compression_level = 4, int chunk_size = 32, int queue_size = 16);
+
+  // Copy one field per resolution (in the order given to open) into the queue,
+  // blocking while it is full. Returns false once a write failed.
+  bool append(const std::vector<DenseField*>& distance_fields, const std::string& name, int label);
+
+  // Write out what is queued, and close the file.
+  bool close(void);
+
+  int getFieldNum(void) const {
+    return field_num_;
+  }
+
+protected:
+  struct Item {
+    std::string name;
+    int label;
+    std::vector<std::vector<float> > values;
+    std::vector<std::vector<float> > signed_values;
+    std::vector<std::vector<float> > metas;
+  };
+
+  void writeLoop(void);
+
+protected:
+  std::string filename_;
+  std::vector<int> resolutions_;
+  bool with_sign_;
+
+  std::thread writer_;
+  std::mutex mutex_;
+  std::condition_variable queue_not_empty_;
+  std::condition_variable queue_not_full_;
+  std::deque<Item> queue_;
+  size_t queue_size_;
+  bool closing_;
+  bool failed_;
+  int field_num_;
+};
+
+#endif // FIELD_ARCHIVE_H
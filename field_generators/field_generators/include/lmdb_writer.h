@@ -0,0 +1,53 @@
+#pragma once
+#ifndef LMDB_WRITER_H
+#define LMDB_WRITER_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <utility>
+
+struct MDB_env;
+
+class DenseField;
+
+// Caffe Datum records in an LMDB database, as convert_hdf5_to_lmdb.py writes
+// them: keyed by the zero padded index in the filelist, channels, height and
+// width being the field resolution, and the values either as float_data or as
+// uint8 data.
+// Records are serialized by the calling threads and committed in batches.
+// Needs the build to find LMDB (USE_LMDB), open fails otherwise.
+class LmdbWriter {
+public:
+  LmdbWriter(void);
+  virtual ~LmdbWriter(void);
+
+  bool open(const std::string& folder, int txn_batch = 1024);
+
+  // Thread safe. Unless save_float, values are stored as bytes, the distances
+  // in voxels floored and clamped to 0..255, whatever the field quantization.
+  bool put(const DenseField* distance_field, int index, int label, bool save_float);
+
+  // Commit what is pending, and close the database.
+  bool close(void);
+
+  int getRecordNum(void) const {
+    return record_num_;
+  }
+
+  // Protocol buffer wire format of caffe::Datum.
+  static void serializeDatum(const DenseField* distance_field, int label, bool save_float, std::string& datum);
+
+protected:
+  bool commit(void);
+
+protected:
+  MDB_env* env_;
+  unsigned int dbi_;
+  std::mutex mutex_;
+  std::vector<std::pair<std::string, std::string> > pending_;
+  size_t txn_batch_;
+  int record_num_;
+};
+
+#endif // LMDB_WRITER_H
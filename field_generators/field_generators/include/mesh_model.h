@@ -4,7 +4,7 @@
 
 #include "renderable.h"
 
-class OSGViewerWidget;
+class DenseField;
 
 class MeshModel: public Renderable {
 public:
@@ -14,15 +14,58 @@ public:
   META_Renderable(MeshModel)
   ;
 
-  bool load(const std::string& filename, OSGViewerWidget* osg_viewer_widget = nullptr);
+  bool load(const std::string& filename);
   bool save(const std::string& filename);
   bool empty(void) const {
     return vertices_->empty();
   }
 
-  double virtualScan(PclPointCloud::Ptr point_cloud, int resolution, double noise);
+  // The OpenGL scanners render in an offscreen context, which takes a display, view by
+  // view, rendering the next view while reading back the last one, or all views at once
+  // (see Renderable::virtualScanAsync and Renderable::virtualScanTiled); the ray casting one
+  // needs nothing but the CPU. All of them run on thread_num threads but for the rendering.
+  double virtualScan(PclPointCloud::Ptr point_cloud, int resolution, double noise, ScanEngine engine = ScanEngine::OPENGL, int thread_num = 1);
 
-  double sampleScan(PclPointCloud::Ptr point_cloud, int resolution, double noise);
+  double sampleScan(PclPointCloud::Ptr point_cloud, int resolution, double noise, ScanEngine engine = ScanEngine::OPENGL, int thread_num = 1);
+  // The directions of sampleScan() scanned one by one, each the farthest from those
+  // scanned before it (the first one first, ties to the lower index), until a view adds
+  // less than min_gain times the voxels covered so far, or max_view_num views have been
+  // scanned, if positive. Voxels are twice the grid size of the scan. The number of
+  // views scanned goes into view_num.
+  double sampleScanAdaptive(PclPointCloud::Ptr point_cloud, int resolution, double noise, double min_gain, int max_view_num = 0,
+      int* view_num = nullptr, ScanEngine engine = ScanEngine::OPENGL, int thread_num = 1);
+  static void getSampleScanDirections(osg::Vec3Array* eye_directions);
+
+  // point_num points drawn uniformly over the area of the triangles placed by the matrix
+  // of this node, with the normals of their faces, for meshes that need no occlusion of
+  // a scan: triangles are picked through an alias table of their areas, and points in
+  // them by barycentric coordinates. Points are drawn in chunks, by generators seeded
+  // with seed and the chunk, so they are the same for any thread_num. With thinning,
+  // points closer than thinning times the average spacing to a point kept before them
+  // are dropped, as in Poisson disk sampling. Returns the average spacing, or a negative
+  // value if the mesh has no area.
+  double sampleSurface(PclPointCloud::Ptr point_cloud, int point_num, double thinning = 0.0, int thread_num = 1, unsigned int seed = 0);
+
+  // Counterpart of Renderable::virtualScan that casts a ray through every pixel center
+  // instead of rendering, and unprojects the hits as that does the depth buffer: the
+  // same points, normals and noise, but for the precision of the buffers. Parallel
+  // across the pixel columns of all views.
+  double rayCastScan(const osg::Vec3Array* eyes, const osg::Vec3Array* centers, const osg::Vec3Array* ups, int resolution, double noise,
+      std::vector<PclPointCloud::Ptr>& point_clouds, float fovy = 43.0f, int thread_num = 1);
+
+  // Polygons are split into triangle fans.
+  void getTriangles(std::vector<Eigen::Vector3f>& vertices, std::vector<Eigen::Vector3i>& triangles) const;
+  void setTriangles(const std::vector<Eigen::Vector3f>& vertices, const std::vector<Eigen::Vector3i>& triangles);
+
+  // Exact unsigned distance (in voxels) from every voxel center to the mesh triangles,
+  // clamped to truncation if it is positive. With with_sign, the inside mask of the
+  // field is filled from generalized winding numbers as well, and with with_normals,
+  // the normal of the closest triangle is recorded per voxel.
+  bool buildDistanceField(DenseField* distance_field, float truncation = 0.0f, int thread_num = 1, bool with_sign = false,
+      bool with_normals = false);
+  // Several resolutions of the same field at once, framed identically, sharing one BVH.
+  bool buildDistanceFields(const std::vector<DenseField*>& distance_fields, float truncation = 0.0f, int thread_num = 1,
+      bool with_sign = false, bool with_normals = false);
 
   void merge(const MeshModel& mesh_model, osg::Matrix transformation = osg::Matrix::identity());
 
@@ -35,6 +78,14 @@ public:
 protected:
   virtual void updateImpl(void);
 
+  double scan(const osg::Vec3Array* eye_directions, PclPointCloud::Ptr point_cloud, int resolution, double noise, ScanEngine engine,
+      int thread_num);
+
+  // What the OpenGL scanner renders: the triangles placed by the matrix of this node,
+  // and the (object space) normals of the faces they are fanned from.
+  void getPlacedTriangles(std::vector<Eigen::Vector3f>& vertices, std::vector<Eigen::Vector3i>& triangles,
+      std::vector<osg::Vec3>& triangle_normals);
+
 protected:
   osg::ref_ptr<osg::Vec3Array> vertices_;
   osg::ref_ptr<osg::Vec4Array> colors_;
@@ -27,7 +27,8 @@ public:
   bool getSampleScanParameters(int& sample_scan_resolution);
 
   int getDistanceFieldResolution(void) const;
-  bool getDistanceFieldParameters(int& distance_field_resolution);
+  double getDistanceFieldTruncation(void) const;
+  bool getDistanceFieldParameters(int& distance_field_resolution, double& distance_field_truncation);
 
   double getNormalEstimationRadius(void) const;
   bool getNormalEstimationRadius(double& normal_estimation_radius);
@@ -55,6 +56,7 @@ private:
   boost::shared_ptr<IntParameter> sample_scan_resolution_;
 
   boost::shared_ptr<IntParameter> distance_field_resolution_;
+  boost::shared_ptr<DoubleParameter> distance_field_truncation_;
 
   boost::shared_ptr<IntParameter> virtual_scan_resolution_;
   boost::shared_ptr<DoubleParameter> virtual_scan_noise_;
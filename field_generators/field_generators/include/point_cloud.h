@@ -61,7 +61,16 @@ public:
   }
   osg::Vec4 getColor(const PclPoint& point, PointCloudColorMode color_mode) const;
 
-  bool buildDistanceField(DenseField* distance_field);
+  // With a positive truncation (in voxels), distances are clamped to it and
+  // voxels outside the band around the points are not searched at all. The
+  // voxels are split into slabs along x and processed by thread_num threads.
+  // With with_normals, the normal of the nearest point is recorded per voxel too.
+  bool buildDistanceField(DenseField* distance_field, DistanceFieldEngine engine = DistanceFieldEngine::KD_TREE, float truncation = 0.0f,
+      int thread_num = 1, bool with_normals = false);
+  // Several resolutions of the same field at once, framed identically. The points
+  // are filtered once for the finest level, and the kd-tree is shared by all.
+  bool buildDistanceFields(const std::vector<DenseField*>& distance_fields, DistanceFieldEngine engine = DistanceFieldEngine::KD_TREE,
+      float truncation = 0.0f, int thread_num = 1, bool with_normals = false);
 
 protected:
   virtual void updateImpl(void);
@@ -70,6 +79,10 @@ protected:
 
   void renderNormals(void);
 
+  void buildDistanceFieldKdTree(DenseField* distance_field, PclPointCloud::Ptr data_filtered, PclSearchTree::Ptr search_tree, float truncation,
+      int thread_num);
+  void buildDistanceFieldEDT(DenseField* distance_field, PclPointCloud::Ptr data_filtered, float truncation, int thread_num);
+
 private:
   PclPointCloud::Ptr data_;
   PclSearchTree::Ptr tree_;
@@ -74,16 +74,44 @@ public:
   virtual void pickEvent(PickMode pick_mode) {
   }
 
+  // Renders in the offscreen context of the calling thread for the size of the scan (see
+  // ScanContext), so scans on different threads may run concurrently. Returns the grid
+  // size of the scan, or a negative value if no offscreen context could be created.
+  // The depth buffer of each view is unprojected on thread_num threads, into the same
+  // points whatever the number of threads.
   double virtualScan(const osg::Vec3Array* eyes, const osg::Vec3Array* centers, const osg::Vec3Array* ups, int resolution, double noise,
-      std::vector<pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr>& point_clouds, float fovy = 43.0f);
+      std::vector<pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr>& point_clouds, float fovy = 43.0f, int thread_num = 1);
   double virtualScan(const osg::Vec3Array* eyes, const osg::Vec3Array* centers, const osg::Vec3Array* ups, int resolution, double noise,
-      pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr point_cloud, float fovy = 43.0f);
+      pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr point_cloud, float fovy = 43.0f, int thread_num = 1);
   double virtualScan(const osg::Vec3& eye, const osg::Vec3& center, const osg::Vec3& up, int width, int height, double noise,
-      pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr point_cloud, float fovy = 43.0f);
+      pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr point_cloud, float fovy = 43.0f, int thread_num = 1);
   double virtualScan(const osg::Vec3Array* eye_directions, int resolution, double noise,
-      std::vector<pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr>& point_clouds, float fovy = 43.0f);
-  double virtualScan(const osg::Vec3Array* eye_directions, int resolution, double noise, pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr point_cloud, float fovy = 43.0f);
+      std::vector<pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr>& point_clouds, float fovy = 43.0f, int thread_num = 1);
+  double virtualScan(const osg::Vec3Array* eye_directions, int resolution, double noise, pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr point_cloud, float fovy = 43.0f,
+      int thread_num = 1);
+
+  // The views rendered as tiles of one framebuffer, in one traversal with one readback
+  // per batch of views that fits, and unprojected in parallel over the tiles. The tiles
+  // are projected onto the depth range of the bounding box rather than the one OSG
+  // computes per frame, so the points may differ from those of virtualScan() within
+  // the precision of the depth buffer.
+  double virtualScanTiled(const osg::Vec3Array* eyes, const osg::Vec3Array* centers, const osg::Vec3Array* ups, int resolution, double noise,
+      std::vector<PclPointCloud::Ptr>& point_clouds, float fovy = 43.0f, int thread_num = 1);
+
+  // The points of virtualScan(), with the views read back asynchronously (see ScanContext)
+  // and each unprojected while the next one is rendered. The time the unprojection ran
+  // alongside the rendering is profiled as stage unproject_overlap, to be compared with
+  // stage unproject. Falls back to virtualScan() without pixel buffer objects.
+  double virtualScanAsync(const osg::Vec3Array* eyes, const osg::Vec3Array* centers, const osg::Vec3Array* ups, int resolution, double noise,
+      std::vector<PclPointCloud::Ptr>& point_clouds, float fovy = 43.0f, int thread_num = 1);
+
 protected:
+  // Noise of a scan, drawn in the order virtualScan() draws it, view by view and point by point.
+  static void addScanNoise(std::vector<PclPointCloud::Ptr>& point_clouds, double noise);
+
+  // Views looking at the center of the bounding box along eye_directions, from 2.5 radii away.
+  void getScanViews(const osg::Vec3Array* eye_directions, osg::Vec3Array* eyes, osg::Vec3Array* centers, osg::Vec3Array* ups);
+
   friend class UpdateCallback;
   void update(void);
   friend class ForceUpdateVisitor;
@@ -95,8 +123,6 @@ protected:
   osg::ref_ptr<osg::MatrixTransform> content_root_;
   bool expired_;
   bool hidden_;
-
-  static std::mutex mutex_graphics_context_;
 };
 
 #endif // RENDERABLE_H
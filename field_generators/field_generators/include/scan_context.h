@@ -0,0 +1,95 @@
+#pragma once
+#ifndef SCAN_CONTEXT_H
+#define SCAN_CONTEXT_H
+
+#include <mutex>
+#include <memory>
+
+#include <osg/Node>
+#include <osg/Group>
+#include <osg/Image>
+#include <osg/Camera>
+#include <osgViewer/Viewer>
+
+// Offscreen rendering setup of the virtual scanner: a viewer rendering into a pbuffer
+// of its own, with the depth buffer and the normal shaded color buffer read back into
+// images every frame. Creating one costs a round trip to the display server and the
+// realization of the viewer, so they are kept per thread and size, and reused by all
+// scans of that size on that thread, each swapping in its own scene.
+//
+// With asynchronous readback, the buffers are instead read into one of two pixel buffer
+// objects at the end of each frame, which does not wait for the GPU, and copied into
+// images by readBack() later on. Rendering of the next view can thus be started before
+// the last one is read back, and the GPU renders while the CPU works on the last view.
+class ScanContext {
+public:
+  virtual ~ScanContext(void);
+
+  // The context of the calling thread for width x height, created on first use, or null
+  // if no offscreen context can be created, or no pixel buffer objects for asynchronous
+  // readback. It stays valid until the thread exits or calls release(), or acquires a
+  // few contexts of other sizes.
+  static ScanContext* acquire(int width, int height, bool async_readback = false);
+  // Drops all contexts of the calling thread.
+  static void release(void);
+
+  int getWidth(void) const {
+    return width_;
+  }
+  int getHeight(void) const {
+    return height_;
+  }
+
+  osg::Camera* getCamera(void) {
+    return viewer_->getCamera();
+  }
+  // Read back every frame, without asynchronous readback.
+  osg::Image* getColorImage(void) {
+    return color_image_.get();
+  }
+  osg::Image* getDepthImage(void) {
+    return depth_image_.get();
+  }
+
+  // With asynchronous readback, copies the buffers of the oldest frame not read back yet
+  // into the images, which are to be allocated as getColorImage() and getDepthImage() are.
+  // At most two frames may be rendered ahead of their readback, and those left after a
+  // failed readback are dropped.
+  bool readBack(osg::Image* color_image, osg::Image* depth_image);
+
+  // The scene scanned by the coming frames, null to let go of the last one.
+  void setScene(osg::Node* scene);
+
+  void frame(void) {
+    viewer_->frame();
+  }
+
+protected:
+  ScanContext(void);
+
+  bool create(int width, int height, bool async_readback);
+  bool createPixelBuffers(osg::GraphicsContext* graphics_context);
+  // Issues the reading of the buffers into the next pixel buffer object, in the draw.
+  void readPixels(void);
+
+  struct PixelBuffers;
+  class ReadbackCallback;
+
+protected:
+  int width_;
+  int height_;
+  // Stamp of the last acquisition, for evicting the least recently used context.
+  size_t last_use_;
+
+  osg::ref_ptr<osgViewer::Viewer> viewer_;
+  osg::ref_ptr<osg::Group> root_;
+  osg::ref_ptr<osg::Image> color_image_;
+  osg::ref_ptr<osg::Image> depth_image_;
+  std::unique_ptr<PixelBuffers> pixel_buffers_;
+
+  // Context creation and deletion are not thread safe in all windowing systems.
+  static std::mutex mutex_graphics_context_;
+  static const size_t max_contexts_per_thread_ = 4;
+};
+
+#endif // SCAN_CONTEXT_H
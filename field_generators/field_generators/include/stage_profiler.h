@@ -0,0 +1,96 @@
+#pragma once
+#ifndef STAGE_PROFILER_H
+#define STAGE_PROFILER_H
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Wall time spent in the stages of batch generation. Each thread appends its
+// timings to a buffer of its own, so recording takes no lock; the reports are
+// aggregated from all buffers, and are to be saved once the workers are done.
+// While disabled, which is the default, timers cost one atomic load.
+class StageProfiler {
+public:
+  StageProfiler(void);
+  virtual ~StageProfiler(void) {
+  }
+
+  static StageProfiler* getInstance(void);
+
+  void setEnabled(bool enabled) {
+    enabled_ = enabled;
+  }
+  bool isEnabled(void) const {
+    return enabled_;
+  }
+
+  // stage is kept by pointer, use string literals.
+  void record(const char* stage, const std::chrono::steady_clock::time_point& start, const std::chrono::steady_clock::time_point& end,
+      double bytes);
+
+  // Per stage and per thread: count, busy time, latency mean and percentiles,
+  // and items/s and bytes/s over the span from the first start to the last end.
+  // JSON, or CSV if filename ends with .csv.
+  bool saveReport(const std::string& filename);
+
+  // Trace event format, for chrome://tracing or Perfetto.
+  bool saveTrace(const std::string& filename);
+
+protected:
+  struct Sample {
+    const char* stage;
+    int64_t start;
+    int64_t duration;
+    double bytes;
+  };
+
+  struct ThreadBuffer {
+    int thread_idx;
+    std::vector<Sample> samples;
+  };
+
+  ThreadBuffer* getThreadBuffer(void);
+
+protected:
+  std::atomic_bool enabled_;
+  std::chrono::steady_clock::time_point origin_;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<ThreadBuffer> > thread_buffers_;
+};
+
+// Times the enclosing scope as one sample of stage.
+class StageTimer {
+public:
+  StageTimer(const char* stage, double bytes = 0.0) :
+      stage_(stage), bytes_(bytes), running_(StageProfiler::getInstance()->isEnabled()) {
+    if (running_)
+      start_ = std::chrono::steady_clock::now();
+  }
+  ~StageTimer(void) {
+    stop();
+  }
+
+  void setBytes(double bytes) {
+    bytes_ = bytes;
+  }
+
+  void stop(void) {
+    if (!running_)
+      return;
+    running_ = false;
+    StageProfiler::getInstance()->record(stage_, start_, std::chrono::steady_clock::now(), bytes_);
+  }
+
+private:
+  const char* stage_;
+  double bytes_;
+  bool running_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#endif // STAGE_PROFILER_H
@@ -0,0 +1,84 @@
+#pragma once
+#ifndef TRIANGLE_BVH_H
+#define TRIANGLE_BVH_H
+
+#include <vector>
+
+#include <Eigen/Core>
+
+// Bounding volume hierarchy over a triangle soup, built by median splits on the
+// longest axis of the triangle centroids.
+class TriangleBVH {
+public:
+  TriangleBVH(void);
+  virtual ~TriangleBVH(void);
+
+  void build(const std::vector<Eigen::Vector3f>& vertices, const std::vector<Eigen::Vector3i>& triangles);
+
+  bool empty(void) const {
+    return triangles_.empty();
+  }
+  const std::vector<Eigen::Vector3f>& getVertices(void) const {
+    return vertices_;
+  }
+  const std::vector<Eigen::Vector3i>& getTriangles(void) const {
+    return triangles_;
+  }
+
+  // Squared distance from query to the closest triangle, searching only within
+  // max_distance_squared. On input, triangle may hold a hint (e.g. the closest
+  // triangle of a neighbouring query) that is tested first to tighten the bound;
+  // on output it holds the closest triangle, or -1 if none is within range.
+  float closestPoint(const Eigen::Vector3f& query, float max_distance_squared, int& triangle, Eigen::Vector3f& closest) const;
+
+  // Generalized winding number of the triangles around query (Jacobson et al. 2013),
+  // with the far-field dipole approximation of Barill et al. 2018 for nodes whose
+  // bounding sphere is more than beta radii away. Robust to holes and
+  // non-manifold parts: about 1 inside, about 0 outside, in between near gaps.
+  float windingNumber(const Eigen::Vector3f& query, float beta = 2.0f) const;
+
+  // First hit of the ray origin+t*direction, t in [t_min, t_max], with the triangles,
+  // from either side. Returns the triangle hit, or -1 if none, and t of the hit.
+  int intersectRay(const Eigen::Vector3f& origin, const Eigen::Vector3f& direction, float t_min, float t_max, float& t) const;
+
+  static float solidAngle(const Eigen::Vector3f& query, const Eigen::Vector3f& a, const Eigen::Vector3f& b, const Eigen::Vector3f& c);
+
+  static Eigen::Vector3f closestPointOnTriangle(const Eigen::Vector3f& p, const Eigen::Vector3f& a, const Eigen::Vector3f& b,
+      const Eigen::Vector3f& c);
+
+protected:
+  struct Node {
+    Eigen::Vector3f min;
+    Eigen::Vector3f max;
+    // Children for inner nodes, [start, start+count) in triangle_indices_ for leaves.
+    int left;
+    int right;
+    int start;
+    int count;
+    // Area weighted center, sum of area weighted normals, and the radius of the
+    // sphere around center that bounds the triangles, for the dipole approximation.
+    Eigen::Vector3f center;
+    Eigen::Vector3f normal;
+    float radius;
+
+    bool isLeaf(void) const {
+      return left < 0;
+    }
+  };
+
+  int buildNode(int start, int end, std::vector<Eigen::Vector3f>& centroids);
+
+  static float boxDistanceSquared(const Node& node, const Eigen::Vector3f& p);
+  // Entry t of the ray into the box of node, or infinity if it misses within [t_min, t_max].
+  static float boxEntry(const Node& node, const Eigen::Vector3f& origin, const Eigen::Vector3f& inverse_direction, float t_min, float t_max);
+
+protected:
+  std::vector<Eigen::Vector3f> vertices_;
+  std::vector<Eigen::Vector3i> triangles_;
+  std::vector<int> triangle_indices_;
+  std::vector<Node> nodes_;
+
+  static const int leaf_size_ = 4;
+};
+
+#endif // TRIANGLE_BVH_H
@@ -0,0 +1,217 @@
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <sstream>
+
+#include <boost/filesystem.hpp>
+
+#include "build_manifest.h"
+
+static const uint64_t fnv_offset_basis = 14695981039346656037ULL;
+static const uint64_t fnv_prime = 1099511628211ULL;
+
+BuildManifest::BuildManifest(void) :
+    hash_sources_(false), verify_outputs_(false), skipped_num_(0) {
+}
+
+BuildManifest::~BuildManifest(void) {
+  close();
+}
+
+static uint64_t hashBytes(const char* bytes, size_t size, uint64_t hash) {
+  for (size_t i = 0; i < size; ++ i) {
+    hash ^= (unsigned char)(bytes[i]);
+    hash *= fnv_prime;
+  }
+  return hash;
+}
+
+static std::string toHex(uint64_t value) {
+  char buffer[17];
+  std::snprintf(buffer, sizeof(buffer), "%016llx", (unsigned long long)(value));
+  return std::string(buffer);
+}
+
+std::string BuildManifest::hashString(const std::string& text) {
+  return toHex(hashBytes(text.data(), text.size(), fnv_offset_basis));
+}
+
+bool BuildManifest::hashFile(const std::string& filename, std::string& hash) {
+  std::ifstream fin(filename, std::ios::binary);
+  if (!fin.good())
+    return false;
+
+  uint64_t value = fnv_offset_basis;
+  std::vector<char> buffer(1 << 20);
+  while (fin) {
+    fin.read(buffer.data(), buffer.size());
+    value = hashBytes(buffer.data(), size_t(fin.gcount()), value);
+  }
+  hash = toHex(value);
+
+  return true;
+}
+
+bool BuildManifest::stampSource(const std::string& source, std::string& stamp) {
+  boost::system::error_code error;
+  uintmax_t size = boost::filesystem::file_size(source, error);
+  if (error)
+    return false;
+  if (!hash_sources_) {
+    std::time_t time = boost::filesystem::last_write_time(source, error);
+    if (error)
+      return false;
+    stamp = std::to_string(size)+":"+std::to_string(int64_t(time));
+    return true;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::map<std::string, std::string>::const_iterator it = source_stamps_.find(source);
+    if (it != source_stamps_.end()) {
+      stamp = it->second;
+      return true;
+    }
+  }
+  std::string hash;
+  if (!hashFile(source, hash))
+    return false;
+  stamp = std::to_string(size)+":"+hash;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  source_stamps_[source] = stamp;
+  return true;
+}
+
+void BuildManifest::writeEntry(std::ostream& out, const std::string& output, const Entry& entry) {
+  out << output << "\t" << entry.source_stamp << "\t" << entry.parameters_hash << "\t" << entry.output_size << "\t"
+      << entry.output_time << "\t" << entry.output_checksum << "\n";
+
+  return;
+}
+
+bool BuildManifest::open(const std::string& filename, bool hash_sources, bool verify_outputs) {
+  close();
+  filename_ = filename;
+  hash_sources_ = hash_sources;
+  verify_outputs_ = verify_outputs;
+  entries_.clear();
+  source_stamps_.clear();
+  skipped_num_ = 0;
+
+  std::ifstream fin(filename_);
+  std::string line;
+  while (std::getline(fin, line)) {
+    std::vector<std::string> fields;
+    std::stringstream stream(line);
+    std::string field;
+    while (std::getline(stream, field, '\t'))
+      fields.push_back(field);
+    // A record cut short by a crash is just dropped.
+    if (fields.size() != 6 || fields[5].size() != 16)
+      continue;
+
+    Entry entry;
+    entry.source_stamp = fields[1];
+    entry.parameters_hash = fields[2];
+    entry.output_size = std::strtoull(fields[3].c_str(), nullptr, 10);
+    entry.output_time = std::strtoll(fields[4].c_str(), nullptr, 10);
+    entry.output_checksum = fields[5];
+    entries_[fields[0]] = entry;
+  }
+  // Start on a line of its own after such a record.
+  bool ends_with_newline = true;
+  fin.clear();
+  fin.seekg(0, std::ios::end);
+  if (fin.good() && fin.tellg() > 0) {
+    fin.seekg(-1, std::ios::end);
+    ends_with_newline = (fin.get() == '\n');
+  }
+  fin.close();
+
+  journal_.open(filename_, std::ios::app);
+  if (!ends_with_newline)
+    journal_ << "\n";
+  return journal_.good();
+}
+
+bool BuildManifest::isUpToDate(const std::string& output, const std::string& source, const std::string& parameters) {
+  std::string source_stamp;
+  if (!journal_.is_open() || !stampSource(source, source_stamp))
+    return false;
+
+  Entry entry;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::map<std::string, Entry>::const_iterator it = entries_.find(output);
+    if (it == entries_.end())
+      return false;
+    entry = it->second;
+  }
+  if (entry.source_stamp != source_stamp || entry.parameters_hash != hashString(parameters))
+    return false;
+
+  boost::system::error_code error;
+  uintmax_t size = boost::filesystem::file_size(output, error);
+  if (error || size != entry.output_size)
+    return false;
+  std::time_t time = boost::filesystem::last_write_time(output, error);
+  if (error || int64_t(time) != entry.output_time)
+    return false;
+
+  if (verify_outputs_) {
+    std::string checksum;
+    if (!hashFile(output, checksum) || checksum != entry.output_checksum)
+      return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  skipped_num_ ++;
+  return true;
+}
+
+bool BuildManifest::record(const std::string& output, const std::string& source, const std::string& parameters) {
+  if (!journal_.is_open())
+    return false;
+
+  Entry entry;
+  if (!stampSource(source, entry.source_stamp) || !hashFile(output, entry.output_checksum))
+    return false;
+  entry.parameters_hash = hashString(parameters);
+  boost::system::error_code error;
+  entry.output_size = boost::filesystem::file_size(output, error);
+  if (error)
+    return false;
+  entry.output_time = int64_t(boost::filesystem::last_write_time(output, error));
+  if (error)
+    return false;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_[output] = entry;
+  writeEntry(journal_, output, entry);
+  journal_.flush();
+
+  return journal_.good();
+}
+
+bool BuildManifest::close(void) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!journal_.is_open())
+    return true;
+  journal_.close();
+
+  // Compact the journal, through a temporary file so that a crash meanwhile loses nothing.
+  std::string filename_tmp = filename_+".tmp";
+  {
+    std::ofstream fout(filename_tmp);
+    for (std::map<std::string, Entry>::const_iterator it = entries_.begin(); it != entries_.end(); ++ it)
+      writeEntry(fout, it->first, it->second);
+    if (!fout.good())
+      return false;
+  }
+  boost::system::error_code error;
+  boost::filesystem::rename(filename_tmp, filename_, error);
+
+  return !error;
+}
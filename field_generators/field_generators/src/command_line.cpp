@@ -1,7 +1,16 @@
 #include <tuple>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 #include <thread>
 #include <fstream>
+#include <sstream>
 #include <iostream>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <cstdlib>
 
 #include <boost/filesystem.hpp>
 
@@ -11,47 +20,658 @@
 #include "mesh_model.h"
 #include "point_cloud.h"
 #include "dense_field.h"
+#include "field_archive.h"
+#include "lmdb_writer.h"
+#include "bounded_queue.h"
+#include "build_manifest.h"
+#include "stage_profiler.h"
 
 #include "command_line.h"
 
-DEFINE_string(df_list, "", "Path to distance field list");
+DEFINE_string(df_list, "", "Path to distance field list, each line a source, a resolution or comma separated resolutions, and a target");
+DEFINE_string(df_source, "scan", "Distance field source: scan (virtual scan point cloud, via .pcd) or mesh (exact distance to the mesh triangles)");
+DEFINE_bool(df_signed, false, "Also save a signed distance field, with the sign from generalized winding numbers (mesh source only)");
+DEFINE_bool(df_normals, false, "Also save the normal of the nearest surface point of every voxel as a NormalField dataset");
+DEFINE_string(df_engine, "kdtree", "Distance field engine: kdtree, edt, or compare (save kdtree, report deviation of edt from it)");
+DEFINE_double(df_truncation, 0.0, "Distance field truncation distance in voxels, 0 for no truncation");
+DEFINE_string(df_quantization, "float32", "Distance field storage: float32, float16, or uint8 (over [0, df_truncation], or [0, max] without truncation)");
+DEFINE_string(df_compression, "none", "Distance field compression: none, deflate, lzf or szip (the latter two fall back to deflate if unavailable)");
+DEFINE_int32(df_compression_level, 4, "Deflate compression level, 0-9");
+DEFINE_int32(df_chunk_size, 32, "Edge length of the HDF5 chunks of compressed distance fields");
+DEFINE_bool(df_report_io, false, "Read every saved distance field back to report read throughput, besides write throughput and compression ratio");
+DEFINE_string(df_archive, "", "Pack all distance fields into this single .h5 archive instead of one file per item");
+DEFINE_string(df_label_list, "", "Filelist in the same order as df_list, with the labels in the last column, for the archive index");
+DEFINE_string(df_lmdb, "", "Write the (finest) distance fields as Caffe Datum records into this LMDB folder instead of .h5 files");
+DEFINE_bool(df_lmdb_float, false, "Save LMDB records as float_data rather than uint8 data");
+DEFINE_int32(df_lmdb_txn_batch, 1024, "LMDB transaction batch size");
+DEFINE_int32(thread_num, 0, "Number of threads, 0 for all hardware threads");
+DEFINE_int32(convert_thread_num, 0, "Number of threads converting meshes to point clouds, each rendering in its own offscreen context, 0 for thread_num");
+DEFINE_string(scan_engine, "auto", "Virtual scanner: opengl, opengl_tiled (all views in one framebuffer), opengl_async "
+    "(each view read back and unprojected while the next one is rendered), surface (points sampled uniformly over the triangles, "
+    "for clean meshes that need no scan), ray_cast "
+    "(on the CPU, for nodes without display or GPU), or auto for opengl, and ray_cast once no offscreen context can be created");
+DEFINE_int32(scan_thread_num, 1, "Number of threads of each scan, on top of the items scanned concurrently");
+DEFINE_double(scan_adaptive_gain, 0.0, "Scan the views one by one, each the farthest from those scanned, until one adds less than this "
+    "fraction of new surface (counted in voxels), 0 to scan all views");
+DEFINE_int32(scan_max_views, 0, "Most views of an adaptive scan, 0 for all candidate views");
+DEFINE_int32(surface_point_num, 100000, "Number of points sampled with --scan_engine=surface");
+DEFINE_double(surface_thinning, 0.0, "With --scan_engine=surface, drop points closer than this times the average spacing to others, "
+    "as in Poisson disk sampling, 0 to keep all");
+DEFINE_bool(df_longest_first, false, "Process the items in decreasing size of their source files, so that the long ones do not end up last");
+DEFINE_int32(df_split_resolution, 128, "Fields at or above this resolution are built one at a time with all threads, smaller ones concurrently with one thread each, "
+    "streaming or not");
+DEFINE_bool(df_streaming, false, "Stream the items through mesh loading, scanning, voxel filtering, field building and writing stages "
+    "connected by bounded queues, instead of converting all of them to .pcd files first");
+DEFINE_bool(df_cache_pcd, false, "With --df_streaming, reuse the .pcd files of earlier runs, and save the new point clouds as .pcd files too");
+DEFINE_int32(stream_queue_size, 8, "Capacity of the queues between the streaming stages");
+DEFINE_int32(stream_load_threads, 2, "Number of mesh loading threads when streaming, 0 for thread_num");
+DEFINE_int32(stream_scan_threads, 0, "Number of scanning threads when streaming, 0 for thread_num");
+DEFINE_int32(stream_filter_threads, 2, "Number of voxel filtering threads when streaming, 0 for thread_num");
+DEFINE_int32(stream_field_threads, 0, "Number of field building threads when streaming, 0 for thread_num");
+DEFINE_int32(stream_write_threads, 1, "Number of writing threads when streaming, 0 for thread_num");
+DEFINE_string(df_manifest, "", "Manifest of the generated .pcd and .h5 files, so that reruns only redo items whose source, parameters or output changed");
+DEFINE_bool(df_manifest_hash, false, "Stamp sources in the manifest by content hash rather than by size and modification time");
+DEFINE_bool(df_manifest_verify, false, "Checksum the outputs again when checking them against the manifest");
+DEFINE_string(profile_report, "", "Save the time spent per stage, with latency percentiles and throughput, into this .json or .csv file");
+DEFINE_string(profile_trace, "", "Save the timeline of all stages of all threads into this Chrome trace .json file");
 DEFINE_bool(skip_converting, false, "Skip converting mesh to point cloud");
 DEFINE_bool(skip_generation, false, "Skip distance field generation");
 
 namespace CommandLine {
 
-  typedef std::tuple<std::string, int, std::string> DFItem;
+  // Source, resolutions, target, label and line index in the df_list. Resolutions are sorted
+  // from fine to coarse, the finest one being the primary level of the target file.
+  typedef std::tuple<std::string, std::vector<int>, std::string, int, int> DFItem;
 
-  void generateDistanceField(std::vector<DFItem> df_list, int thread_num, int thread_idx) {
-    int step = 100;
-    int count = 0;
-    for (int i = thread_idx, i_end = df_list.size(); i < i_end; i += thread_num) {
-      const std::string filename_df = std::get<2>(df_list[i]);
-      LOG(INFO) << "Thread " << thread_idx << ": Processing " << filename_df << "..." << std::endl;
+  FieldArchive* field_archive = nullptr;
+  LmdbWriter* lmdb_writer = nullptr;
+  BuildManifest* build_manifest = nullptr;
 
+  std::mutex mutex_deviation;
+  double max_deviation_all = 0.0;
+  double sum_deviation_all = 0.0;
+  int compared_num = 0;
+
+  std::mutex mutex_io;
+  double uncompressed_bytes_all = 0.0;
+  double file_bytes_all = 0.0;
+  double write_seconds_all = 0.0;
+  double read_seconds_all = 0.0;
+
+  bool parseCompression(const std::string& text, FieldCompression& compression) {
+    if (text == "none") {
+      compression = FieldCompression::NONE;
+    } else if (text == "deflate") {
+      compression = FieldCompression::DEFLATE;
+    } else if (text == "lzf") {
+      compression = FieldCompression::LZF;
+    } else if (text == "szip") {
+      compression = FieldCompression::SZIP;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  bool buildDistanceFields(PointCloud* point_cloud, const std::vector<DenseField*>& distance_fields, const std::string& filename_df,
+      int thread_idx, int field_thread_num) {
+    if (FLAGS_df_engine == "kdtree") {
+      return point_cloud->buildDistanceFields(distance_fields, DistanceFieldEngine::KD_TREE, FLAGS_df_truncation, field_thread_num,
+          FLAGS_df_normals);
+    } else if (FLAGS_df_engine == "edt") {
+      return point_cloud->buildDistanceFields(distance_fields, DistanceFieldEngine::EDT, FLAGS_df_truncation, field_thread_num,
+          FLAGS_df_normals);
+    } else if (FLAGS_df_engine == "compare") {
+      std::vector<osg::ref_ptr<DenseField> > distance_fields_edt;
+      std::vector<DenseField*> distance_fields_edt_ptr;
+      for (size_t i = 0, i_end = distance_fields.size(); i < i_end; ++ i) {
+        distance_fields_edt.push_back(new DenseField(distance_fields[i]->getResolution()));
+        distance_fields_edt_ptr.push_back(distance_fields_edt.back().get());
+      }
+      if (!point_cloud->buildDistanceFields(distance_fields, DistanceFieldEngine::KD_TREE, FLAGS_df_truncation, field_thread_num,
+              FLAGS_df_normals)
+          || !point_cloud->buildDistanceFields(distance_fields_edt_ptr, DistanceFieldEngine::EDT, FLAGS_df_truncation, field_thread_num,
+              FLAGS_df_normals))
+        return false;
+
+      for (size_t i = 0, i_end = distance_fields.size(); i < i_end; ++ i) {
+        double max_deviation, mean_deviation;
+        distance_fields_edt[i]->computeDeviation(distance_fields[i], max_deviation, mean_deviation);
+        LOG(INFO) << "Thread " << thread_idx << ": Deviation of edt from kdtree on " << filename_df
+            << " at resolution " << distance_fields[i]->getResolution()
+            << ": max " << max_deviation << ", mean " << mean_deviation << " (voxels)" << std::endl;
+
+        std::lock_guard<std::mutex> lock(mutex_deviation);
+        max_deviation_all = std::max(max_deviation_all, max_deviation);
+        sum_deviation_all += mean_deviation;
+        compared_num ++;
+      }
+      return true;
+    }
+
+    LOG(ERROR) << "Unknown distance field engine " << FLAGS_df_engine << "!" << std::endl;
+    return false;
+  }
+
+  // The finest level goes to the primary datasets, the coarser ones are appended as extra levels.
+  bool saveDistanceFields(const std::vector<DenseField*>& distance_fields, const std::string& filename_df) {
+    FieldQuantization quantization = FieldQuantization::FLOAT32;
+    if (FLAGS_df_quantization == "float16") {
+      quantization = FieldQuantization::FLOAT16;
+    } else if (FLAGS_df_quantization == "uint8") {
+      quantization = FieldQuantization::UINT8;
+    } else if (FLAGS_df_quantization != "float32") {
+      LOG(ERROR) << "Unknown distance field quantization " << FLAGS_df_quantization << "!" << std::endl;
+      return false;
+    }
+
+    FieldCompression compression;
+    if (!parseCompression(FLAGS_df_compression, compression)) {
+      LOG(ERROR) << "Unknown distance field compression " << FLAGS_df_compression << "!" << std::endl;
+      return false;
+    }
+
+    double uncompressed_bytes = 0.0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0, i_end = distance_fields.size(); i < i_end; ++ i) {
+      distance_fields[i]->setQuantization(quantization, FLAGS_df_truncation);
+      distance_fields[i]->setCompression(compression, FLAGS_df_compression_level, FLAGS_df_chunk_size);
+      if (!distance_fields[i]->save(filename_df, i != 0))
+        return false;
+      uncompressed_bytes += distance_fields[i]->getUncompressedSize();
+    }
+    std::chrono::duration<double> write_seconds = std::chrono::steady_clock::now()-start;
+
+    std::chrono::duration<double> read_seconds(0.0);
+    if (FLAGS_df_report_io) {
+      start = std::chrono::steady_clock::now();
+      for (size_t i = 0, i_end = distance_fields.size(); i < i_end; ++ i) {
+        osg::ref_ptr <DenseField> distance_field(new DenseField);
+        if (!distance_field->load(filename_df, (i == 0) ? 0 : distance_fields[i]->getResolution()))
+          return false;
+      }
+      read_seconds = std::chrono::steady_clock::now()-start;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_io);
+    uncompressed_bytes_all += uncompressed_bytes;
+    file_bytes_all += boost::filesystem::file_size(filename_df);
+    write_seconds_all += write_seconds.count();
+    read_seconds_all += read_seconds.count();
+    return true;
+  }
+
+  // What a point cloud depends on besides the mesh.
+  std::string getScanParameters(void) {
+    std::stringstream parameters;
+    if (FLAGS_scan_engine == "surface")
+      parameters << "surface " << FLAGS_surface_point_num << " " << FLAGS_surface_thinning;
+    else if (FLAGS_scan_adaptive_gain > 0.0)
+      parameters << "scan 100 adaptive " << FLAGS_scan_adaptive_gain << " " << FLAGS_scan_max_views;
+    else
+      parameters << "scan 100";
+    return parameters.str();
+  }
+
+  bool isAdaptiveScan(void) {
+    return FLAGS_scan_adaptive_gain > 0.0 && FLAGS_scan_engine != "surface";
+  }
+
+  std::atomic_bool opengl_unavailable(false);
+  std::atomic_int scanned_item_num(0);
+  std::atomic_int scanned_view_num(0);
+
+  int getScanCandidateNum(void) {
+    osg::ref_ptr < osg::Vec3Array > eye_directions = new osg::Vec3Array;
+    MeshModel::getSampleScanDirections(eye_directions);
+    return int(eye_directions->size());
+  }
+
+  // All candidate views, or as many as --scan_adaptive_gain and --scan_max_views take.
+  double sampleScan(MeshModel* mesh_model, PclPointCloud::Ptr point_cloud, ScanEngine engine, int& view_num) {
+    if (FLAGS_scan_adaptive_gain <= 0.0) {
+      view_num = getScanCandidateNum();
+      return mesh_model->sampleScan(point_cloud, 100, 0.0, engine, FLAGS_scan_thread_num);
+    }
+    return mesh_model->sampleScanAdaptive(point_cloud, 100, 0.0, FLAGS_scan_adaptive_gain, FLAGS_scan_max_views, &view_num, engine,
+        FLAGS_scan_thread_num);
+  }
+
+  // Scan with --scan_engine, falling back from OpenGL to ray casting with auto.
+  // Returns the grid size of the scan, or a negative value if it failed.
+  double scanMesh(MeshModel* mesh_model, PclPointCloud::Ptr point_cloud, int& view_num) {
+    if (FLAGS_scan_engine == "surface") {
+      view_num = 0;
+      return mesh_model->sampleSurface(point_cloud, FLAGS_surface_point_num, FLAGS_surface_thinning, FLAGS_scan_thread_num);
+    }
+
+    double grid_size = -1.0;
+    if (FLAGS_scan_engine != "ray_cast" && !opengl_unavailable) {
+      ScanEngine engine = ScanEngine::OPENGL;
+      if (FLAGS_scan_engine == "opengl_tiled")
+        engine = ScanEngine::OPENGL_TILED;
+      else if (FLAGS_scan_engine == "opengl_async")
+        engine = ScanEngine::OPENGL_ASYNC;
+      grid_size = sampleScan(mesh_model, point_cloud, engine, view_num);
+      if (grid_size <= 0.0 && FLAGS_scan_engine != "opengl" && engine == ScanEngine::OPENGL) {
+        if (!opengl_unavailable.exchange(true)) {
+          LOG(WARNING) << "No offscreen context for the OpenGL scanner, ray casting from now on!" << std::endl;
+        }
+        point_cloud->clear();
+        grid_size = sampleScan(mesh_model, point_cloud, ScanEngine::RAY_CAST, view_num);
+      }
+    } else {
+      grid_size = sampleScan(mesh_model, point_cloud, ScanEngine::RAY_CAST, view_num);
+    }
+
+    if (grid_size > 0.0) {
+      scanned_item_num ++;
+      scanned_view_num += view_num;
+    }
+    return grid_size;
+  }
+
+  // What the .h5 file of an item depends on besides the mesh.
+  std::string getFieldParameters(const DFItem& df_item) {
+    std::stringstream parameters;
+    parameters << FLAGS_df_source;
+    if (FLAGS_df_source != "mesh")
+      parameters << " " << getScanParameters() << " " << FLAGS_df_engine;
+    const std::vector<int>& resolutions = std::get<1>(df_item);
+    for (size_t i = 0, i_end = resolutions.size(); i < i_end; ++ i)
+      parameters << " " << resolutions[i];
+    parameters << " " << FLAGS_df_truncation << " " << FLAGS_df_signed << " " << FLAGS_df_normals << " " << FLAGS_df_quantization
+        << " " << FLAGS_df_compression << " " << FLAGS_df_compression_level << " " << FLAGS_df_chunk_size;
+    return parameters.str();
+  }
+
+  // Only separate .h5 files are tracked by the manifest, not archives or LMDB records.
+  bool isFieldUpToDate(const DFItem& df_item) {
+    return build_manifest != nullptr && field_archive == nullptr && lmdb_writer == nullptr
+        && build_manifest->isUpToDate(std::get<2>(df_item), std::get<0>(df_item), getFieldParameters(df_item));
+  }
+
+  std::string getPcdFilename(const DFItem& df_item) {
+    boost::filesystem::path path(std::get<2>(df_item));
+    return path.parent_path().string()+"/"+path.stem().string()+".pcd";
+  }
+
+  void createDistanceFields(const DFItem& df_item, std::vector<osg::ref_ptr<DenseField> >& distance_fields,
+      std::vector<DenseField*>& distance_fields_ptr) {
+    const std::vector<int>& resolutions = std::get<1>(df_item);
+    distance_fields.clear();
+    distance_fields_ptr.clear();
+    for (size_t j = 0, j_end = resolutions.size(); j < j_end; ++ j) {
+      distance_fields.push_back(new DenseField(resolutions[j]));
+      distance_fields_ptr.push_back(distance_fields.back().get());
+    }
+
+    return;
+  }
+
+  // Into the archive, the LMDB, or a .h5 file of its own.
+  bool writeDistanceFields(const DFItem& df_item, const std::vector<DenseField*>& distance_fields_ptr, int thread_idx) {
+    const std::string filename_df = std::get<2>(df_item);
+    double uncompressed_bytes = 0.0;
+    for (size_t i = 0, i_end = distance_fields_ptr.size(); i < i_end; ++ i)
+      uncompressed_bytes += distance_fields_ptr[i]->getUncompressedSize();
+    StageTimer timer("write_fields", uncompressed_bytes);
+    if (field_archive != nullptr && !field_archive->append(distance_fields_ptr, filename_df, std::get<3>(df_item))) {
+      LOG(ERROR) << "Thread " << thread_idx << ": Archiving " << filename_df << " failed!" << std::endl;
+      return false;
+    }
+    // Keyed by the line in the df_list, as convert_hdf5_to_lmdb.py does, whatever the processing order.
+    if (lmdb_writer != nullptr
+        && !lmdb_writer->put(distance_fields_ptr[0], std::get<4>(df_item), std::get<3>(df_item), FLAGS_df_lmdb_float)) {
+      LOG(ERROR) << "Thread " << thread_idx << ": Writing " << filename_df << " into LMDB failed!" << std::endl;
+      return false;
+    }
+    if (field_archive == nullptr && lmdb_writer == nullptr) {
+      if (!saveDistanceFields(distance_fields_ptr, filename_df)) {
+        LOG(ERROR) << "Thread " << thread_idx << ": Saving " << filename_df << " failed!" << std::endl;
+        return false;
+      }
+      if (build_manifest != nullptr && !build_manifest->record(filename_df, std::get<0>(df_item), getFieldParameters(df_item))) {
+        LOG(WARNING) << "Thread " << thread_idx << ": Recording " << filename_df << " in the manifest failed!" << std::endl;
+      }
+    }
+
+    return true;
+  }
+
+  // field_thread_num threads are used inside each single field build.
+  bool generateDistanceField(const DFItem& df_item, int thread_idx, int field_thread_num) {
+    const std::string filename_df = std::get<2>(df_item);
+    if (isFieldUpToDate(df_item)) {
+      LOG(INFO) << "Thread " << thread_idx << ": Skipping " << filename_df << " as it is up to date..." << std::endl;
+      return true;
+    }
+    LOG(INFO) << "Thread " << thread_idx << ": Processing " << filename_df << "..." << std::endl;
+    StageTimer timer("generate_item");
+
+    std::vector<osg::ref_ptr<DenseField> > distance_fields;
+    std::vector<DenseField*> distance_fields_ptr;
+    createDistanceFields(df_item, distance_fields, distance_fields_ptr);
+
+    if (FLAGS_df_source == "mesh") {
+      const std::string filename_mesh = std::get<0>(df_item);
+      osg::ref_ptr <MeshModel> mesh_model(new MeshModel);
+      if (!mesh_model->load(filename_mesh)
+          || !mesh_model->buildDistanceFields(distance_fields_ptr, FLAGS_df_truncation, field_thread_num, FLAGS_df_signed,
+              FLAGS_df_normals)) {
+        LOG(ERROR) << "Thread " << thread_idx << ": Building distance field from " << filename_mesh << " failed! Skipping it..." << std::endl;
+        return false;
+      }
+    } else {
       osg::ref_ptr <PointCloud> point_cloud(new PointCloud);
-      boost::filesystem::path path(filename_df);
-      std::string filename_pcd = path.parent_path().string()+"/"+path.stem().string()+".pcd";
+      std::string filename_pcd = getPcdFilename(df_item);
       if(!point_cloud->load(filename_pcd)) {
         LOG(ERROR) << "Thread " << thread_idx << ": Reading " << filename_pcd << " failed! Skipping it..." << std::endl;
-        continue;
+        return false;
+      }
+
+      StageTimer build_timer("build_fields");
+      bool flag = buildDistanceFields(point_cloud, distance_fields_ptr, filename_df, thread_idx, field_thread_num);
+      build_timer.stop();
+      if (!flag) {
+        LOG(ERROR) << "Thread " << thread_idx << ": Building distance field for " << filename_df << " failed! Skipping it..." << std::endl;
+        return false;
       }
+    }
+
+    return writeDistanceFields(df_item, distance_fields_ptr, thread_idx);
+  }
+
+  // Virtual scan of the source mesh, saved next to the target as .pcd. Items whose
+  // .pcd is up to date by the manifest, or without one exists and reads well, are
+  // skipped, so an interrupted run can be resumed.
+  bool convertToPointCloud(const DFItem& df_item, int thread_idx) {
+    std::string filename_pcd = getPcdFilename(df_item);
+    const std::string filename_mesh = std::get<0>(df_item);
+
+    osg::ref_ptr <PointCloud> point_cloud(new PointCloud);
+    if (build_manifest != nullptr) {
+      if (build_manifest->isUpToDate(filename_pcd, filename_mesh, getScanParameters())) {
+        LOG(INFO) << "Thread " << thread_idx << ": Skipping generating " << filename_pcd << " as it is up to date..." << std::endl;
+        return true;
+      }
+    } else if(point_cloud->load(filename_pcd)) {
+      LOG(INFO) << "Thread " << thread_idx << ": Skipping generating " << filename_pcd << " as it exists and reads well..." << std::endl;
+      return true;
+    }
+
+    LOG(INFO) << "Thread " << thread_idx << ": Converting " << filename_mesh << " into point cloud..." << std::endl;
+    StageTimer timer("convert_item");
+    osg::ref_ptr <MeshModel> mesh_model(new MeshModel);
+    if(!mesh_model->load(filename_mesh)) {
+      LOG(ERROR) << "Thread " << thread_idx << ": Reading " << filename_mesh << " failed! Skipping it..." << std::endl;
+      return false;
+    }
+
+    point_cloud->data()->clear();
+    StageTimer scan_timer("scan");
+    int view_num = 0;
+    double grid_size = scanMesh(mesh_model, point_cloud->data(), view_num);
+    scan_timer.stop();
+    if (grid_size <= 0.0 && FLAGS_scan_engine == "surface") {
+      LOG(ERROR) << "Thread " << thread_idx << ": No surface to sample in " << filename_mesh << "! Skipping it..." << std::endl;
+      return false;
+    } else if (grid_size <= 0.0) {
+      LOG(ERROR) << "Thread " << thread_idx << ": No offscreen context for scanning " << filename_mesh
+        << " (--scan_engine=ray_cast needs none)! Skipping it..." << std::endl;
+      return false;
+    }
+    if (isAdaptiveScan()) {
+      LOG(INFO) << "Thread " << thread_idx << ": Scanned " << filename_mesh << " from " << view_num << " views..." << std::endl;
+    }
+    point_cloud->buildTree();
+    point_cloud->voxelGridFilter(grid_size/2, true);
+    if (point_cloud->save(filename_pcd) && build_manifest != nullptr
+        && !build_manifest->record(filename_pcd, filename_mesh, getScanParameters())) {
+      LOG(WARNING) << "Thread " << thread_idx << ": Recording " << filename_pcd << " in the manifest failed!" << std::endl;
+    }
 
-      int resolution = std::get<1>(df_list[i]);
-      osg::ref_ptr <DenseField> distance_field(new DenseField(resolution));
-      point_cloud->buildDistanceField(distance_field);
+    return true;
+  }
 
-      distance_field->save(filename_df);
+  // Items are handed out through a shared cursor, so threads that draw cheap items just take more of them.
+  void processItems(const std::vector<DFItem>& df_list, int thread_num, int field_thread_num) {
+    const int step = 100;
+    std::atomic_int processed_num(0);
+    Common::parallelFor(df_list.size(), thread_num, [&](int i, int thread_idx) {
+      if (!generateDistanceField(df_list[i], thread_idx, field_thread_num))
+        return;
 
-      count ++;
+      int count = ++ processed_num;
       if (count%step == 0) {
-        LOG(INFO) << "Thread " << thread_idx << ":  Processed " << count << " items! (total item number: " << i_end << ")" << std::endl;
+        LOG(INFO) << "Processed " << count << " items! (total item number: " << df_list.size() << ")" << std::endl;
       }
+    });
+
+    return;
+  }
+
+  // An item on its way through the streaming pipeline, each stage filling in what
+  // the next one needs and dropping what is no longer needed.
+  struct StreamItem {
+    int idx;
+    osg::ref_ptr<MeshModel> mesh_model;
+    osg::ref_ptr<PointCloud> point_cloud;
+    double grid_size;
+    std::vector<osg::ref_ptr<DenseField> > distance_fields;
+  };
+
+  // Mesh loading, scanning, voxel filtering, field building and writing, each stage
+  // with threads of its own and bounded queues in between, so that only a few items
+  // per stage are held in memory, and file I/O overlaps with computation. Cached
+  // .pcd files skip the first stages, the mesh source skips scanning and filtering.
+  void streamItems(const std::vector<DFItem>& df_list, int thread_num) {
+    auto getStageThreadNum = [thread_num](int flag) {return (flag > 0) ? flag : thread_num;};
+    int load_thread_num = getStageThreadNum(FLAGS_stream_load_threads);
+    int scan_thread_num = getStageThreadNum(FLAGS_stream_scan_threads);
+    int filter_thread_num = getStageThreadNum(FLAGS_stream_filter_threads);
+    int field_thread_num = getStageThreadNum(FLAGS_stream_field_threads);
+    int write_thread_num = getStageThreadNum(FLAGS_stream_write_threads);
+    LOG(INFO) << "Streaming with " << load_thread_num << " loading, " << scan_thread_num << " scanning, " << filter_thread_num
+        << " filtering, " << field_thread_num << " field building and " << write_thread_num << " writing threads!" << std::endl;
+
+    size_t queue_size = std::max(FLAGS_stream_queue_size, 1);
+    BoundedQueue<StreamItem> scan_queue(queue_size, load_thread_num);
+    BoundedQueue<StreamItem> filter_queue(queue_size, scan_thread_num);
+    BoundedQueue<StreamItem> field_queue(queue_size, load_thread_num+filter_thread_num);
+    BoundedQueue<StreamItem> write_queue(queue_size, field_thread_num);
+
+    bool from_mesh = (FLAGS_df_source == "mesh");
+    const int step = 100;
+    std::atomic_int cursor(0);
+    std::atomic_int processed_num(0);
+    std::vector<std::thread> threads;
+    // Large fields are built one at a time with thread_num threads, as without streaming,
+    // while the other field threads go on with the small ones.
+    std::mutex mutex_large;
+
+    for (int t = 0; t < load_thread_num; ++ t) {
+      threads.push_back(std::thread([&, t]() {
+        for (int i = cursor++; i < int(df_list.size()); i = cursor++) {
+          if (isFieldUpToDate(df_list[i])) {
+            LOG(INFO) << "Load thread " << t << ": Skipping " << std::get<2>(df_list[i]) << " as it is up to date..." << std::endl;
+            continue;
+          }
+
+          StreamItem item;
+          item.idx = i;
+          item.grid_size = 0.0;
+          std::string filename_pcd = getPcdFilename(df_list[i]);
+          // With a manifest, cached point clouds of changed meshes are not used.
+          if (!from_mesh && FLAGS_df_cache_pcd && (build_manifest == nullptr
+              || build_manifest->isUpToDate(filename_pcd, std::get<0>(df_list[i]), getScanParameters()))) {
+            item.point_cloud = new PointCloud;
+            if (item.point_cloud->load(filename_pcd)) {
+              field_queue.push(std::move(item));
+              continue;
+            }
+            item.point_cloud = nullptr;
+          }
+
+          const std::string& filename_mesh = std::get<0>(df_list[i]);
+          item.mesh_model = new MeshModel;
+          if (!item.mesh_model->load(filename_mesh)) {
+            LOG(ERROR) << "Load thread " << t << ": Reading " << filename_mesh << " failed! Skipping it..." << std::endl;
+            continue;
+          }
+          if (from_mesh)
+            field_queue.push(std::move(item));
+          else
+            scan_queue.push(std::move(item));
+        }
+        scan_queue.close();
+        field_queue.close();
+      }));
+    }
+
+    for (int t = 0; t < scan_thread_num; ++ t) {
+      threads.push_back(std::thread([&, t]() {
+        StreamItem item;
+        while (scan_queue.pop(item)) {
+          item.point_cloud = new PointCloud;
+          StageTimer scan_timer("scan");
+          int view_num = 0;
+          item.grid_size = scanMesh(item.mesh_model, item.point_cloud->data(), view_num);
+          scan_timer.stop();
+          item.mesh_model = nullptr;
+          if (item.grid_size <= 0.0 && FLAGS_scan_engine == "surface") {
+            LOG(ERROR) << "Scan thread " << t << ": No surface to sample in " << std::get<0>(df_list[item.idx]) << "! Skipping it..." << std::endl;
+            continue;
+          } else if (item.grid_size <= 0.0) {
+            LOG(ERROR) << "Scan thread " << t << ": No offscreen context for scanning " << std::get<0>(df_list[item.idx])
+              << " (--scan_engine=ray_cast needs none)! Skipping it..." << std::endl;
+            continue;
+          }
+          if (isAdaptiveScan()) {
+            LOG(INFO) << "Scan thread " << t << ": Scanned " << std::get<0>(df_list[item.idx]) << " from " << view_num << " views..." << std::endl;
+          }
+          filter_queue.push(std::move(item));
+        }
+        filter_queue.close();
+      }));
+    }
+
+    for (int t = 0; t < filter_thread_num; ++ t) {
+      threads.push_back(std::thread([&, t]() {
+        StreamItem item;
+        while (filter_queue.pop(item)) {
+          item.point_cloud->buildTree();
+          item.point_cloud->voxelGridFilter(item.grid_size/2, true);
+          if (FLAGS_df_cache_pcd) {
+            std::string filename_pcd = getPcdFilename(df_list[item.idx]);
+            if (!item.point_cloud->save(filename_pcd)) {
+              LOG(WARNING) << "Filter thread " << t << ": Saving " << filename_pcd << " failed!" << std::endl;
+            } else if (build_manifest != nullptr && !build_manifest->record(filename_pcd, std::get<0>(df_list[item.idx]), getScanParameters())) {
+              LOG(WARNING) << "Filter thread " << t << ": Recording " << filename_pcd << " in the manifest failed!" << std::endl;
+            }
+          }
+          field_queue.push(std::move(item));
+        }
+        field_queue.close();
+      }));
+    }
+
+    for (int t = 0; t < field_thread_num; ++ t) {
+      threads.push_back(std::thread([&, t]() {
+        StreamItem item;
+        while (field_queue.pop(item)) {
+          const DFItem& df_item = df_list[item.idx];
+          const std::string filename_df = std::get<2>(df_item);
+          std::vector<DenseField*> distance_fields_ptr;
+          createDistanceFields(df_item, item.distance_fields, distance_fields_ptr);
+          bool large = (std::get<1>(df_item)[0] >= FLAGS_df_split_resolution);
+          std::unique_lock<std::mutex> lock_large(mutex_large, std::defer_lock);
+          if (large)
+            lock_large.lock();
+          int build_thread_num = large ? thread_num : 1;
+          StageTimer build_timer("build_fields");
+          bool flag = from_mesh
+              ? item.mesh_model->buildDistanceFields(distance_fields_ptr, FLAGS_df_truncation, build_thread_num, FLAGS_df_signed, FLAGS_df_normals)
+              : buildDistanceFields(item.point_cloud, distance_fields_ptr, filename_df, t, build_thread_num);
+          build_timer.stop();
+          if (large)
+            lock_large.unlock();
+          item.mesh_model = nullptr;
+          item.point_cloud = nullptr;
+          if (!flag) {
+            LOG(ERROR) << "Field thread " << t << ": Building distance field for " << filename_df << " failed! Skipping it..." << std::endl;
+            continue;
+          }
+          write_queue.push(std::move(item));
+        }
+        write_queue.close();
+      }));
+    }
+
+    for (int t = 0; t < write_thread_num; ++ t) {
+      threads.push_back(std::thread([&, t]() {
+        StreamItem item;
+        while (write_queue.pop(item)) {
+          std::vector<DenseField*> distance_fields_ptr;
+          for (size_t j = 0, j_end = item.distance_fields.size(); j < j_end; ++ j)
+            distance_fields_ptr.push_back(item.distance_fields[j].get());
+          bool flag = writeDistanceFields(df_list[item.idx], distance_fields_ptr, t);
+          item.distance_fields.clear();
+          if (!flag)
+            continue;
+
+          int count = ++ processed_num;
+          if (count%step == 0) {
+            LOG(INFO) << "Processed " << count << " items! (total item number: " << df_list.size() << ")" << std::endl;
+          }
+        }
+      }));
+    }
+
+    for (size_t i = 0, i_end = threads.size(); i < i_end; ++ i)
+      threads[i].join();
+    LOG(INFO) << processed_num << " of " << df_list.size() << " items streamed through!" << std::endl;
+
+    return;
+  }
+
+  // File size of the source, as a cost estimate for longest-job-first ordering.
+  void sortByCost(std::vector<DFItem>& df_list) {
+    std::vector<std::pair<uintmax_t, size_t> > costs(df_list.size());
+    for (size_t i = 0, i_end = df_list.size(); i < i_end; ++ i) {
+      boost::system::error_code error;
+      uintmax_t size = boost::filesystem::file_size(std::get<0>(df_list[i]), error);
+      costs[i] = std::make_pair(error ? 0 : size, i);
     }
+    std::stable_sort(costs.begin(), costs.end(),
+        [](const std::pair<uintmax_t, size_t>& a, const std::pair<uintmax_t, size_t>& b) {return a.first > b.first;});
+
+    std::vector<DFItem> sorted;
+    sorted.reserve(df_list.size());
+    for (size_t i = 0, i_end = costs.size(); i < i_end; ++ i)
+      sorted.push_back(std::move(df_list[costs[i].second]));
+    df_list.swap(sorted);
 
     return;
   }
 
+  bool parseResolutions(const std::string& text, std::vector<int>& resolutions) {
+    resolutions.clear();
+    std::stringstream stream(text);
+    std::string token;
+    while (std::getline(stream, token, ',')) {
+      // The whole token, so that "64x" or "1e2" are not taken for 64 or 1.
+      char* end = nullptr;
+      long resolution = std::strtol(token.c_str(), &end, 10);
+      if (*end != '\0' || resolution <= 0 || resolution > std::numeric_limits<int>::max())
+        return false;
+      resolutions.push_back(int(resolution));
+    }
+    std::sort(resolutions.begin(), resolutions.end(), std::greater<int>());
+    resolutions.erase(std::unique(resolutions.begin(), resolutions.end()), resolutions.end());
+    return !resolutions.empty();
+  }
+
   bool generateDistanceFields(void) {
     if(FLAGS_df_list.empty()) {
       return false;
@@ -62,11 +682,32 @@ namespace CommandLine {
 
     std::vector<DFItem> df_list;
     std::ifstream fin(FLAGS_df_list);
-    std::string source, target;
-    int resolution;
+    std::vector<int> labels;
+    if (!FLAGS_df_label_list.empty()) {
+      std::ifstream fin_label(FLAGS_df_label_list);
+      std::string line;
+      while (std::getline(fin_label, line)) {
+        std::stringstream stream(line);
+        std::string token, last_token;
+        while (stream >> token)
+          last_token = token;
+        if (!last_token.empty())
+          labels.push_back(std::atoi(last_token.c_str()));
+      }
+    }
+
+    std::string source, resolution, target;
     std::set<std::string> folder_set;
+    int line_idx = 0;
     while (fin >> source >> resolution >> target) {
-      df_list.push_back(std::make_tuple(source, resolution, target));
+      int label = (line_idx < int(labels.size())) ? labels[line_idx] : -1;
+      int item_idx = line_idx ++;
+      std::vector<int> resolutions;
+      if (!parseResolutions(resolution, resolutions)) {
+        LOG(ERROR) << "Invalid resolution " << resolution << " for " << source << "! Skipping it..." << std::endl;
+        continue;
+      }
+      df_list.push_back(std::make_tuple(source, resolutions, target, label, item_idx));
       std::string folder = boost::filesystem::path(target).parent_path().string();
       if(folder_set.find(folder) == folder_set.end()) {
         if (!boost::filesystem::exists(folder)) {
@@ -76,54 +717,162 @@ namespace CommandLine {
       }
     }
     LOG(INFO) <<  df_list.size() << " items to be processed!" << std::endl;
+    if (FLAGS_df_signed && FLAGS_df_source != "mesh") {
+      LOG(WARNING) << "Signed distance fields need --df_source=mesh, only unsigned ones will be generated!" << std::endl;
+    }
 
-    if(!FLAGS_skip_converting) {
-      int step = 100;
-      for (int i = 0, i_end = df_list.size(); i < i_end; i ++) {
-        const std::string filename_df = std::get<2>(df_list[i]);
-        boost::filesystem::path path(filename_df);
-        std::string filename_pcd = path.parent_path().string()+"/"+path.stem().string()+".pcd";
+    if (FLAGS_scan_engine != "opengl" && FLAGS_scan_engine != "opengl_tiled" && FLAGS_scan_engine != "opengl_async"
+        && FLAGS_scan_engine != "surface" && FLAGS_scan_engine != "ray_cast" && FLAGS_scan_engine != "auto") {
+      LOG(ERROR) << "Unknown scan engine " << FLAGS_scan_engine << "!" << std::endl;
+      return false;
+    }
 
-        osg::ref_ptr <PointCloud> point_cloud(new PointCloud);
-        if(point_cloud->load(filename_pcd)) {
-          LOG(INFO) << "Skipping generating " << filename_pcd << " as it exists and reads well..." << std::endl;
-          continue;
-        }
+    StageProfiler::getInstance()->setEnabled(!FLAGS_profile_report.empty() || !FLAGS_profile_trace.empty());
 
-        const std::string filename_mesh = std::get<0>(df_list[i]);
-        LOG(INFO) << "Converting " << filename_mesh << " into point cloud..." << std::endl;
-        osg::ref_ptr <MeshModel> mesh_model(new MeshModel);
-        if(!mesh_model->load(filename_mesh)) {
-          LOG(ERROR) << "Reading " << filename_mesh << " failed! Skipping it..." << std::endl;
-          continue;
-        }
+    BuildManifest manifest;
+    if (!FLAGS_df_manifest.empty()) {
+      if (!manifest.open(FLAGS_df_manifest, FLAGS_df_manifest_hash, FLAGS_df_manifest_verify)) {
+        LOG(ERROR) << "Opening manifest " << FLAGS_df_manifest << " failed!" << std::endl;
+        return false;
+      }
+      build_manifest = &manifest;
+    }
 
-        point_cloud->data()->clear();
-        double grid_size = mesh_model->sampleScan(point_cloud->data(), 100, 0.0);
-        point_cloud->buildTree();
-        point_cloud->voxelGridFilter(grid_size/2, true);
-        point_cloud->save(filename_pcd);
+    int n = (FLAGS_thread_num > 0) ? FLAGS_thread_num : std::max(int(std::thread::hardware_concurrency()), 1);
 
-        if ((i+1)%step == 0) {
-          LOG(INFO) << "Converted " << (i+1) << " items! (total item number: " << i_end << ")" << std::endl;
+    // The mesh source computes the fields from the triangles directly, no point clouds needed.
+    // When streaming, the conversion is one of the stages of the generation.
+    if(!FLAGS_skip_converting && FLAGS_df_source != "mesh" && !FLAGS_df_streaming) {
+      int convert_thread_num = (FLAGS_convert_thread_num > 0) ? FLAGS_convert_thread_num : n;
+      LOG(INFO) << "Converting meshes into point clouds with " << convert_thread_num << " threads..." << std::endl;
+      const int step = 100;
+      std::atomic_int converted_num(0);
+      Common::parallelFor(df_list.size(), convert_thread_num, [&](int i, int thread_idx) {
+        if (!convertToPointCloud(df_list[i], thread_idx))
+          return;
+
+        int count = ++ converted_num;
+        if (count%step == 0) {
+          LOG(INFO) << "Converted " << count << " items! (total item number: " << df_list.size() << ")" << std::endl;
         }
-      }
+      });
     }
 
     if (!FLAGS_skip_generation) {
-      unsigned int n = std::thread::hardware_concurrency()-4;
-      LOG(INFO) << n << " threads will be used!" << std::endl;
+      FieldCompression compression = FieldCompression::NONE;
+      if (parseCompression(FLAGS_df_compression, compression) && !DenseField::isCompressionAvailable(compression)) {
+        LOG(WARNING) << FLAGS_df_compression << " is not available in this HDF5 library, deflate will be used instead!" << std::endl;
+      }
 
-      std::vector<std::thread> threads;
-      for (unsigned int i = 0; i < n; ++ i) {
-        std::thread thread_obj(generateDistanceField, df_list, n, i);
-        threads.push_back(std::move(thread_obj));
+      FieldArchive archive;
+      if (!FLAGS_df_archive.empty() && !df_list.empty()) {
+        const std::vector<int>& resolutions = std::get<1>(df_list[0]);
+        for (size_t i = 0, i_end = df_list.size(); i < i_end; ++ i) {
+          if (std::get<1>(df_list[i]) != resolutions) {
+            LOG(ERROR) << "All items of an archive need the same resolutions!" << std::endl;
+            return false;
+          }
+        }
+        if (FLAGS_df_quantization != "float32" || FLAGS_df_normals) {
+          LOG(WARNING) << "Archives hold float32 distance fields only, quantization and normal fields are ignored!" << std::endl;
+        }
+        bool with_sign = FLAGS_df_signed && FLAGS_df_source == "mesh";
+        if (!archive.open(FLAGS_df_archive, resolutions, with_sign, compression, FLAGS_df_compression_level, FLAGS_df_chunk_size)) {
+          LOG(ERROR) << "Creating archive " << FLAGS_df_archive << " failed!" << std::endl;
+          return false;
+        }
+        field_archive = &archive;
       }
 
-      for (unsigned int i = 0; i < n; ++ i) {
-        threads[i].join();
+      LmdbWriter lmdb;
+      if (!FLAGS_df_lmdb.empty()) {
+        if (FLAGS_df_label_list.empty()) {
+          LOG(WARNING) << "No --df_label_list given, LMDB records will be labeled -1!" << std::endl;
+        }
+        if (!lmdb.open(FLAGS_df_lmdb, FLAGS_df_lmdb_txn_batch)) {
+          LOG(ERROR) << "Opening LMDB " << FLAGS_df_lmdb << " failed (is the build configured with LMDB?)!" << std::endl;
+          return false;
+        }
+        lmdb_writer = &lmdb;
+      }
+
+      LOG(INFO) << n << " threads will be used!" << std::endl;
+      if (FLAGS_df_streaming) {
+        if (FLAGS_df_longest_first) {
+          sortByCost(df_list);
+        }
+        streamItems(df_list, n);
+      } else {
+        // Large fields are split across all threads one at a time, small ones run concurrently one per thread.
+        std::vector<DFItem> df_list_large, df_list_small;
+        for (size_t i = 0, i_end = df_list.size(); i < i_end; ++ i) {
+          if (std::get<1>(df_list[i])[0] >= FLAGS_df_split_resolution)
+            df_list_large.push_back(df_list[i]);
+          else
+            df_list_small.push_back(df_list[i]);
+        }
+        if (FLAGS_df_longest_first) {
+          sortByCost(df_list_large);
+          sortByCost(df_list_small);
+        }
+        if (!df_list_large.empty()) {
+          LOG(INFO) << df_list_large.size() << " large items will be processed with " << n << " threads each!" << std::endl;
+          processItems(df_list_large, 1, n);
+        }
+        processItems(df_list_small, n, 1);
       }
       LOG(INFO) << "Distance field generation done!" << std::endl;
+
+      if (field_archive != nullptr) {
+        if (!archive.close()) {
+          LOG(ERROR) << "Writing archive " << FLAGS_df_archive << " failed!" << std::endl;
+        }
+        LOG(INFO) << archive.getFieldNum() << " distance fields archived into " << FLAGS_df_archive << "!" << std::endl;
+        field_archive = nullptr;
+      }
+
+      if (lmdb_writer != nullptr) {
+        if (!lmdb.close()) {
+          LOG(ERROR) << "Writing LMDB " << FLAGS_df_lmdb << " failed!" << std::endl;
+        }
+        LOG(INFO) << lmdb.getRecordNum() << " records written into " << FLAGS_df_lmdb << "!" << std::endl;
+        lmdb_writer = nullptr;
+      }
+
+      if (file_bytes_all != 0.0) {
+        const double mb = 1024.0*1024.0;
+        LOG(INFO) << "Saved " << uncompressed_bytes_all/mb << " MB of fields into " << file_bytes_all/mb << " MB of files, compression ratio "
+            << uncompressed_bytes_all/file_bytes_all << ", write throughput " << uncompressed_bytes_all/mb/write_seconds_all << " MB/s"
+            << " (per thread)" << std::endl;
+        if (FLAGS_df_report_io && read_seconds_all != 0.0) {
+          LOG(INFO) << "Read throughput " << uncompressed_bytes_all/mb/read_seconds_all << " MB/s (per thread)" << std::endl;
+        }
+      }
+
+      if (compared_num != 0) {
+        LOG(INFO) << "Deviation of edt from kdtree over " << compared_num << " items: max " << max_deviation_all
+            << ", mean " << sum_deviation_all/compared_num << " (voxels)" << std::endl;
+      }
+    }
+
+    if (isAdaptiveScan() && scanned_item_num != 0) {
+      LOG(INFO) << "Adaptive scans took " << scanned_view_num << " views for " << scanned_item_num << " items, "
+          << double(scanned_view_num)/scanned_item_num << " per item of " << getScanCandidateNum() << " candidates!" << std::endl;
+    }
+
+    if (build_manifest != nullptr) {
+      LOG(INFO) << manifest.getSkippedNum() << " outputs were up to date by the manifest!" << std::endl;
+      if (!manifest.close()) {
+        LOG(ERROR) << "Writing manifest " << FLAGS_df_manifest << " failed!" << std::endl;
+      }
+      build_manifest = nullptr;
+    }
+
+    if (!FLAGS_profile_report.empty() && !StageProfiler::getInstance()->saveReport(FLAGS_profile_report)) {
+      LOG(ERROR) << "Saving profile report " << FLAGS_profile_report << " failed!" << std::endl;
+    }
+    if (!FLAGS_profile_trace.empty() && !StageProfiler::getInstance()->saveTrace(FLAGS_profile_trace)) {
+      LOG(ERROR) << "Saving profile trace " << FLAGS_profile_trace << " failed!" << std::endl;
     }
 
     return true;
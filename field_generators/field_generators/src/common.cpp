@@ -1,3 +1,7 @@
+#include <atomic>
+#include <algorithm>
+#include <thread>
+#include <vector>
 #include <sstream>
 #include <iomanip>
 
@@ -26,4 +30,26 @@ void randomK(std::vector<int>& random_k, int k, int N) {
 
   return;
 }
+
+void parallelFor(int item_num, int thread_num, const std::function<void(int, int)>& func) {
+  thread_num = std::max(std::min(thread_num, item_num), 1);
+  if (thread_num == 1) {
+    for (int i = 0; i < item_num; ++i)
+      func(i, 0);
+    return;
+  }
+
+  std::atomic_int cursor(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_num; ++t) {
+    threads.push_back(std::thread([&cursor, &func, item_num, t]() {
+      for (int i = cursor++; i < item_num; i = cursor++)
+        func(i, t);
+    }));
+  }
+  for (int t = 0; t < thread_num; ++t)
+    threads[t].join();
+
+  return;
+}
 }
@@ -4,7 +4,7 @@
 
 #include "color_map.h"
 #include "osg_utility.h"
-#include "osg_viewer_widget.h"
+#include "stage_profiler.h"
 
 #include "H5Cpp.h"
 
@@ -15,11 +15,13 @@ using namespace H5;
 #include "dense_field.h"
 
 DenseField::DenseField(void) :
-    resolution_(0), data_(NULL) {
+    resolution_(0), data_(NULL), quantization_(FieldQuantization::FLOAT32), quantization_truncation_(0.0f),
+    compression_(FieldCompression::NONE), compression_level_(4), chunk_size_(32) {
 }
 
 DenseField::DenseField(int resolution) :
-    resolution_(resolution), data_(NULL) {
+    resolution_(resolution), data_(NULL), quantization_(FieldQuantization::FLOAT32), quantization_truncation_(0.0f),
+    compression_(FieldCompression::NONE), compression_level_(4), chunk_size_(32) {
   int voxel_num = resolution_ * resolution_ * resolution_;
   data_ = new float[voxel_num];
   memset(data_, 0, voxel_num * sizeof(float));
@@ -62,14 +64,140 @@ void DenseField::updateImpl(void) {
   return;
 }
 
-bool DenseField::readHdf5File(const std::string& filename) {
+// IEEE half precision, laid out the same way as numpy/h5py float16.
+static FloatType halfFloatType(void) {
+  FloatType data_type(PredType::IEEE_F32LE);
+  data_type.setFields(15, 10, 5, 0, 10);
+  data_type.setSize(2);
+  data_type.setEbias(15);
+  return data_type;
+}
+
+// Registered filter id of LZF, as shipped with h5py.
+static const H5Z_filter_t lzf_filter = 32000;
+
+bool DenseField::isCompressionAvailable(FieldCompression compression) {
+  switch (compression) {
+  case FieldCompression::NONE:
+    return true;
+  case FieldCompression::DEFLATE:
+    return H5Zfilter_avail(H5Z_FILTER_DEFLATE) > 0;
+  case FieldCompression::LZF:
+    return H5Zfilter_avail(lzf_filter) > 0;
+  case FieldCompression::SZIP: {
+    unsigned int config = 0;
+    return H5Zfilter_avail(H5Z_FILTER_SZIP) > 0 && H5Zget_filter_info(H5Z_FILTER_SZIP, &config) >= 0
+        && (config & H5Z_FILTER_CONFIG_ENCODE_ENABLED) != 0;
+  }
+  }
+
+  return false;
+}
+
+void DenseField::setCompressionFilter(DSetCreatPropList& property_list, FieldCompression compression, int level) {
+  if (compression != FieldCompression::NONE && !isCompressionAvailable(compression))
+    compression = FieldCompression::DEFLATE;
+  switch (compression) {
+  case FieldCompression::DEFLATE:
+    property_list.setShuffle();
+    property_list.setDeflate(level);
+    break;
+  case FieldCompression::LZF:
+    property_list.setShuffle();
+    property_list.setFilter(lzf_filter, H5Z_FLAG_OPTIONAL);
+    break;
+  case FieldCompression::SZIP:
+    property_list.setSzip(H5_SZIP_NN_OPTION_MASK, 32);
+    break;
+  default:
+    break;
+  }
+
+  return;
+}
+
+static DSetCreatPropList createPropertyList(FieldCompression compression, int level, int chunk_size, int rank, const hsize_t* dims) {
+  DSetCreatPropList property_list;
+  if (compression == FieldCompression::NONE)
+    return property_list;
+
+  // Spatial chunks, the trailing channel dimension of the normals kept whole.
+  std::vector<hsize_t> chunk_dims(dims, dims + rank);
+  for (int i = 0; i < std::min(rank, 3); ++ i)
+    chunk_dims[i] = std::min(dims[i], hsize_t(std::max(chunk_size, 1)));
+  property_list.setChunk(rank, chunk_dims.data());
+  DenseField::setCompressionFilter(property_list, compression, level);
+
+  return property_list;
+}
+
+static void writeValues(H5File& file, const std::string& name, const DataSpace& data_space, const DSetCreatPropList& property_list,
+    const float* values, int value_num, FieldQuantization quantization, float scale, float offset) {
+  FloatType data_type(PredType::NATIVE_FLOAT);
+  data_type.setOrder(H5T_ORDER_LE);
+
+  switch (quantization) {
+  case FieldQuantization::FLOAT32: {
+    DataSet data_set = file.createDataSet(name, data_type, data_space, property_list);
+    data_set.write(values, data_type);
+    break;
+  }
+  case FieldQuantization::FLOAT16: {
+    DataSet data_set = file.createDataSet(name, halfFloatType(), data_space, property_list);
+    data_set.write(values, data_type);
+    break;
+  }
+  case FieldQuantization::UINT8: {
+    std::vector<unsigned char> quantized(value_num);
+    for (int i = 0; i < value_num; ++ i) {
+      float q = std::floor((values[i]-offset)/scale+0.5f);
+      quantized[i] = (unsigned char)(std::min(std::max(q, 0.0f), 255.0f));
+    }
+    DataSet data_set = file.createDataSet(name, PredType::STD_U8LE, data_space, property_list);
+    data_set.write(quantized.data(), PredType::NATIVE_UCHAR);
+    break;
+  }
+  }
+
+  return;
+}
+
+// The stored type tells the quantization, so files written before it existed,
+// whose Meta[4..7] are not meaningful, still read as float32.
+static FieldQuantization readValues(DataSet& data_set, float* values, int value_num, float scale, float offset) {
+  if (data_set.getTypeClass() == H5T_INTEGER) {
+    std::vector<unsigned char> quantized(value_num);
+    data_set.read(quantized.data(), PredType::NATIVE_UCHAR);
+    for (int i = 0; i < value_num; ++ i)
+      values[i] = quantized[i]*scale+offset;
+    return FieldQuantization::UINT8;
+  }
+
+  FloatType data_type(PredType::NATIVE_FLOAT);
+  data_type.setOrder(H5T_ORDER_LE);
+  data_set.read(values, data_type);
+
+  return (data_set.getFloatType().getSize() == 2) ? FieldQuantization::FLOAT16 : FieldQuantization::FLOAT32;
+}
+
+bool DenseField::readHdf5File(const std::string& filename, const std::string& suffix) {
+  StageTimer timer("hdf5_read");
   try {
     H5File file(filename, H5F_ACC_RDONLY);
 
     FloatType data_type(PredType::NATIVE_FLOAT);
     data_type.setOrder(H5T_ORDER_LE);
 
-    DataSet data_set = file.openDataSet("DenseField");
+    DataSet data_set_meta = file.openDataSet("Meta"+suffix);
+    const int dim_meta = 256;
+    float data_meta[dim_meta];
+    data_set_meta.read(data_meta, data_type);
+    step_ = data_meta[0];
+    x_min_ = data_meta[1];
+    y_min_ = data_meta[2];
+    z_min_ = data_meta[3];
+
+    DataSet data_set = file.openDataSet("DenseField"+suffix);
     DataSpace data_space = data_set.getSpace();
     const int dim = 3;
     hsize_t dims[dim];
@@ -78,16 +206,26 @@ bool DenseField::readHdf5File(const std::string& filename) {
     delete data_;
     int voxel_num = resolution_ * resolution_ * resolution_;
     data_ = new float[voxel_num];
-    data_set.read(data_, data_type);
+    quantization_ = readValues(data_set, data_, voxel_num, data_meta[4], data_meta[5]);
+    quantization_truncation_ = (quantization_ == FieldQuantization::UINT8) ? 255*data_meta[4] : 0.0f;
 
-    DataSet data_set_meta = file.openDataSet("Meta");
-    const int dim_meta = 256;
-    float data_meta[dim_meta];
-    data_set_meta.read(data_meta, data_type);
-    step_ = data_meta[0];
-    x_min_ = data_meta[1];
-    y_min_ = data_meta[2];
-    z_min_ = data_meta[3];
+    inside_.clear();
+    if (H5Lexists(file.getId(), ("SignedDenseField"+suffix).c_str(), H5P_DEFAULT) > 0) {
+      std::vector<float> signed_data(voxel_num);
+      DataSet data_set_signed = file.openDataSet("SignedDenseField"+suffix);
+      readValues(data_set_signed, signed_data.data(), voxel_num, data_meta[6], data_meta[7]);
+      inside_.resize(voxel_num);
+      for (int i = 0; i < voxel_num; ++ i)
+        inside_[i] = (signed_data[i] < 0) ? 1 : 0;
+    }
+
+    normals_.clear();
+    if (H5Lexists(file.getId(), ("NormalField"+suffix).c_str(), H5P_DEFAULT) > 0) {
+      normals_.resize(3 * voxel_num);
+      DataSet data_set_normal = file.openDataSet("NormalField"+suffix);
+      data_set_normal.read(normals_.data(), data_type);
+    }
+    timer.setBytes(double(getUncompressedSize()));
   } catch (FileIException error) {
     error.printError();
     return false;
@@ -105,7 +243,7 @@ bool DenseField::readHdf5File(const std::string& filename) {
   return true;
 }
 
-bool DenseField::load(const std::string& filename, OSGViewerWidget* osg_viewer_widget) {
+bool DenseField::load(const std::string& filename, int level) {
   QWriteLocker locker(&read_write_lock_);
   expired_ = true;
 
@@ -115,23 +253,29 @@ bool DenseField::load(const std::string& filename, OSGViewerWidget* osg_viewer_w
   bool flag = false;
   std::string extension = boost::filesystem::path(filename).extension().string();
   if (extension == ".h5") {
-    flag = readHdf5File(filename);
-  }
-
-  locker.unlock();
-  if (flag && osg_viewer_widget != nullptr) {
-    osg_viewer_widget->centerScene();
+    flag = readHdf5File(filename, (level == 0) ? std::string() : "_"+std::to_string(level));
   }
 
   return flag;
 }
 
-bool DenseField::saveHdf5File(const std::string& filename) {
+bool DenseField::saveHdf5File(const std::string& filename, const std::string& suffix) {
+  StageTimer timer("hdf5_write", double(getUncompressedSize()));
   try {
-    H5File file(filename, H5F_ACC_TRUNC);
+    H5File file(filename, suffix.empty() ? H5F_ACC_TRUNC : H5F_ACC_RDWR);
 
     FloatType data_type(PredType::NATIVE_FLOAT);
     data_type.setOrder(H5T_ORDER_LE);
+
+    int voxel_num = resolution_ * resolution_ * resolution_;
+    float scale = 1.0f, offset = 0.0f;
+    float signed_scale = 1.0f, signed_offset = 0.0f;
+    if (quantization_ == FieldQuantization::UINT8) {
+      float range = getQuantizationRange();
+      scale = range/255;
+      signed_scale = 2*range/255;
+      signed_offset = -range;
+    }
  
     const int dim = 3;
     hsize_t dims[dim];
@@ -139,19 +283,46 @@ bool DenseField::saveHdf5File(const std::string& filename) {
     dims[1] = resolution_;
     dims[2] = resolution_;
     DataSpace data_space(dim, dims);
-    DataSet data_set = file.createDataSet("DenseField", data_type, data_space);
-    data_set.write(data_, data_type);
+    DSetCreatPropList property_list = createPropertyList(compression_, compression_level_, chunk_size_, dim, dims);
+    writeValues(file, "DenseField"+suffix, data_space, property_list, data_, voxel_num, quantization_, scale, offset);
+
+    if (isSigned()) {
+      std::vector<float> signed_data(data_, data_ + voxel_num);
+      for (int i = 0; i < voxel_num; ++ i) {
+        if (inside_[i])
+          signed_data[i] = -signed_data[i];
+      }
+      writeValues(file, "SignedDenseField"+suffix, data_space, property_list, signed_data.data(), voxel_num, quantization_, signed_scale,
+          signed_offset);
+    }
+
+    if (hasNormals()) {
+      const int dim_normal = 4;
+      hsize_t dims_normal[dim_normal];
+      dims_normal[0] = resolution_;
+      dims_normal[1] = resolution_;
+      dims_normal[2] = resolution_;
+      dims_normal[3] = 3;
+      DataSpace data_space_normal(dim_normal, dims_normal);
+      DSetCreatPropList property_list_normal = createPropertyList(compression_, compression_level_, chunk_size_, dim_normal, dims_normal);
+      DataSet data_set_normal = file.createDataSet("NormalField"+suffix, data_type, data_space_normal, property_list_normal);
+      data_set_normal.write(normals_.data(), data_type);
+    }
 
     hsize_t dims_meta[1];
     const int dim_meta = 256;
     dims_meta[0] = dim_meta;
     DataSpace data_space_meta(1, dims_meta);
-    DataSet data_set_meta = file.createDataSet("Meta", data_type, data_space_meta);
-    float data_meta[dim_meta];
+    DataSet data_set_meta = file.createDataSet("Meta"+suffix, data_type, data_space_meta);
+    float data_meta[dim_meta] = {0};
     data_meta[0] = step_;
     data_meta[1] = x_min_;
     data_meta[2] = y_min_;
     data_meta[3] = z_min_;
+    data_meta[4] = scale;
+    data_meta[5] = offset;
+    data_meta[6] = signed_scale;
+    data_meta[7] = signed_offset;
     data_set_meta.write(data_meta, data_type);
   } catch (FileIException error) {
     error.printError();
@@ -165,19 +336,72 @@ bool DenseField::saveHdf5File(const std::string& filename) {
   } catch (DataTypeIException error) {
     error.printError();
     return false;
+  } catch (PropListIException error) {
+    error.printError();
+    return false;
+  }
+
+  return true;
+}
+
+float DenseField::getQuantizationRange(void) const {
+  float range = quantization_truncation_;
+  if (range <= 0.0f) {
+    int voxel_num = resolution_ * resolution_ * resolution_;
+    for (int i = 0; i < voxel_num; ++ i)
+      range = std::max(range, data_[i]);
+  }
+
+  return (range > 0.0f) ? range : 1.0f;
+}
+
+size_t DenseField::getUncompressedSize(void) const {
+  size_t voxel_num = size_t(resolution_) * resolution_ * resolution_;
+  size_t channel_num = 1 + (isSigned() ? 1 : 0) + (hasNormals() ? 3 : 0);
+  return voxel_num * channel_num * sizeof(float);
+}
+
+void DenseField::fitBoundingBox(double x_min, double y_min, double z_min, double x_max, double y_max, double z_max, double padding_scale) {
+  double x_center = (x_min+x_max)/2;
+  double y_center = (y_min+y_max)/2;
+  double z_center = (z_min+z_max)/2;
+
+  double x_range = x_max-x_min;
+  double y_range = y_max-y_min;
+  double z_range = z_max-z_min;
+  double range = padding_scale*std::max(x_range, std::max(y_range, z_range));
+
+  setCorner(x_center-range/2, y_center-range/2, z_center-range/2);
+  setStep(range/resolution_);
+
+  return;
+}
+
+bool DenseField::computeDeviation(const DenseField* reference, double& max_deviation, double& mean_deviation) const {
+  if (reference->resolution_ != resolution_ || resolution_ == 0)
+    return false;
+
+  max_deviation = 0.0;
+  mean_deviation = 0.0;
+  int voxel_num = resolution_ * resolution_ * resolution_;
+  for (int i = 0; i < voxel_num; ++ i) {
+    double deviation = std::abs(data_[i] - reference->data_[i]);
+    max_deviation = std::max(max_deviation, deviation);
+    mean_deviation += deviation;
   }
+  mean_deviation /= voxel_num;
 
   return true;
 }
 
-bool DenseField::save(const std::string& filename) {
+bool DenseField::save(const std::string& filename, bool append) {
   QReadLocker locker(&read_write_lock_);
   expired_ = true;
 
   bool flag = false;
   std::string extension = boost::filesystem::path(filename).extension().string();
   if (extension == ".h5") {
-    flag = saveHdf5File(filename);
+    flag = saveHdf5File(filename, append ? "_"+std::to_string(resolution_) : std::string());
   }
 
   return flag;
@@ -0,0 +1,241 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include "common.h"
+
+#include "distance_transform.h"
+
+void DistanceTransform::transform1D(const float* f, int n, float* d, int* arg, int* v, double* z) {
+  const double inf = std::numeric_limits<double>::infinity();
+
+  // Lower envelope of the parabolas rooted at the finite samples only.
+  int k = -1;
+  for (int q = 0; q < n; ++q) {
+    if (!std::isfinite(f[q]))
+      continue;
+
+    if (k < 0) {
+      k = 0;
+      v[0] = q;
+      z[0] = -inf;
+      z[1] = inf;
+      continue;
+    }
+
+    // z[0] is -inf, so k never drops below 0 here.
+    double s = 0;
+    while (true) {
+      int p = v[k];
+      s = ((f[q] + double(q) * q) - (f[p] + double(p) * p)) / (2.0 * (q - p));
+      if (s > z[k])
+        break;
+      --k;
+    }
+    ++k;
+    v[k] = q;
+    z[k] = s;
+    z[k + 1] = inf;
+  }
+
+  if (k < 0) {
+    for (int q = 0; q < n; ++q) {
+      d[q] = std::numeric_limits<float>::infinity();
+      arg[q] = -1;
+    }
+    return;
+  }
+
+  k = 0;
+  for (int q = 0; q < n; ++q) {
+    while (z[k + 1] < q)
+      ++k;
+    int p = v[k];
+    d[q] = float(double(q - p) * (q - p) + f[p]);
+    arg[q] = p;
+  }
+
+  return;
+}
+
+void DistanceTransform::computeSquared(const std::vector<char>& occupied, int resolution, std::vector<float>& squared_distances,
+    std::vector<int>& nearest_cells, int thread_num) {
+  int voxel_num = resolution * resolution * resolution;
+  squared_distances.assign(voxel_num, std::numeric_limits<float>::infinity());
+  nearest_cells.assign(voxel_num, -1);
+  for (int i = 0; i < voxel_num; ++i) {
+    if (occupied[i]) {
+      squared_distances[i] = 0.0f;
+      nearest_cells[i] = i;
+    }
+  }
+
+  // Per-thread line buffers.
+  thread_num = std::max(thread_num, 1);
+  std::vector<std::vector<float>> fs(thread_num, std::vector<float>(resolution)), ds(fs);
+  std::vector<std::vector<int>> args(thread_num, std::vector<int>(resolution)), vs(args), nearests(args);
+  std::vector<std::vector<double>> zs(thread_num, std::vector<double>(resolution + 1));
+
+  // One pass per axis: z (contiguous), then y, then x. The lines of a pass are independent.
+  const int strides[3] = { 1, resolution, resolution * resolution };
+  for (int axis = 0; axis < 3; ++axis) {
+    int stride = strides[axis];
+    int outer_stride = (axis == 2) ? resolution : resolution * resolution;
+    int inner_stride = (axis == 0) ? resolution : 1;
+    Common::parallelFor(resolution, thread_num, [&](int a, int t) {
+      std::vector<float>& f = fs[t];
+      std::vector<float>& d = ds[t];
+      std::vector<int>& arg = args[t];
+      std::vector<int>& v = vs[t];
+      std::vector<int>& nearest = nearests[t];
+      std::vector<double>& z = zs[t];
+      for (int b = 0; b < resolution; ++b) {
+        int offset = a * outer_stride + b * inner_stride;
+        for (int q = 0; q < resolution; ++q) {
+          f[q] = squared_distances[offset + q * stride];
+          nearest[q] = nearest_cells[offset + q * stride];
+        }
+        transform1D(f.data(), resolution, d.data(), arg.data(), v.data(), z.data());
+        for (int q = 0; q < resolution; ++q) {
+          squared_distances[offset + q * stride] = d[q];
+          nearest_cells[offset + q * stride] = (arg[q] < 0) ? (-1) : (nearest[arg[q]]);
+        }
+      }
+    });
+  }
+
+  return;
+}
+
+static int cellIndex(const Eigen::Vector3f& seed, int resolution) {
+  int cell[3];
+  for (int j = 0; j < 3; ++j)
+    cell[j] = std::min(std::max(int(std::floor(seed[j])), 0), resolution - 1);
+  return (cell[0] * resolution + cell[1]) * resolution + cell[2];
+}
+
+void DistanceTransform::rasterize(const std::vector<Eigen::Vector3f>& seeds, int resolution, std::vector<char>& occupied) {
+  occupied.assign(resolution * resolution * resolution, 0);
+  for (size_t i = 0, i_end = seeds.size(); i < i_end; ++i)
+    occupied[cellIndex(seeds[i], resolution)] = 1;
+
+  return;
+}
+
+void DistanceTransform::dilate(std::vector<char>& mask, int resolution, int radius) {
+  if (radius <= 0)
+    return;
+
+  std::vector<int> prefix(resolution + 1);
+  const int strides[3] = { 1, resolution, resolution * resolution };
+  for (int axis = 0; axis < 3; ++axis) {
+    int stride = strides[axis];
+    int outer_stride = (axis == 2) ? resolution : resolution * resolution;
+    int inner_stride = (axis == 0) ? resolution : 1;
+    for (int a = 0; a < resolution; ++a) {
+      for (int b = 0; b < resolution; ++b) {
+        int offset = a * outer_stride + b * inner_stride;
+        prefix[0] = 0;
+        for (int q = 0; q < resolution; ++q)
+          prefix[q + 1] = prefix[q] + (mask[offset + q * stride] ? 1 : 0);
+        if (prefix[resolution] == 0)
+          continue;
+        for (int q = 0; q < resolution; ++q) {
+          int low = std::max(q - radius, 0);
+          int high = std::min(q + radius + 1, resolution);
+          mask[offset + q * stride] = (prefix[high] - prefix[low] > 0) ? 1 : 0;
+        }
+      }
+    }
+  }
+
+  return;
+}
+
+void DistanceTransform::compute(const std::vector<Eigen::Vector3f>& seeds, int resolution, float* field, float truncation, int thread_num,
+    int* nearest_seeds) {
+  int voxel_num = resolution * resolution * resolution;
+
+  // Bucket the seeds by cell, CSR style.
+  std::vector<int> seed_cells(seeds.size());
+  std::vector<int> cell_starts(voxel_num + 1, 0);
+  for (size_t i = 0, i_end = seeds.size(); i < i_end; ++i) {
+    seed_cells[i] = cellIndex(seeds[i], resolution);
+    cell_starts[seed_cells[i] + 1]++;
+  }
+  for (int i = 0; i < voxel_num; ++i)
+    cell_starts[i + 1] += cell_starts[i];
+  std::vector<int> cell_seeds(seeds.size());
+  std::vector<int> cell_fill(cell_starts.begin(), cell_starts.end() - 1);
+  for (size_t i = 0, i_end = seeds.size(); i < i_end; ++i)
+    cell_seeds[cell_fill[seed_cells[i]]++] = i;
+
+  std::vector<char> occupied(voxel_num, 0);
+  for (size_t i = 0, i_end = seeds.size(); i < i_end; ++i)
+    occupied[seed_cells[i]] = 1;
+
+  std::vector<float> squared_distances;
+  std::vector<int> nearest_cells;
+  computeSquared(occupied, resolution, squared_distances, nearest_cells, thread_num);
+
+  // A seed is at most half a cell diagonal away from its cell center.
+  bool truncated = (truncation > 0.0f);
+  float band = truncation + 0.5f * std::sqrt(3.0f);
+  float band_squared = band * band;
+
+  std::vector<std::vector<int>> candidates_per_thread(std::max(thread_num, 1));
+  Common::parallelFor(resolution, thread_num, [&](int i, int t) {
+    std::vector<int>& candidates = candidates_per_thread[t];
+    candidates.reserve(27);
+    for (int j = 0; j < resolution; ++j) {
+      for (int k = 0; k < resolution; ++k) {
+        int idx = (i * resolution + j) * resolution + k;
+        if (nearest_cells[idx] < 0) {
+          field[idx] = truncated ? truncation : std::numeric_limits<float>::max();
+          if (nearest_seeds != nullptr)
+            nearest_seeds[idx] = -1;
+          continue;
+        }
+        if (truncated && squared_distances[idx] > band_squared) {
+          field[idx] = truncation;
+          if (nearest_seeds != nullptr)
+            nearest_seeds[idx] = -1;
+          continue;
+        }
+
+        candidates.clear();
+        for (int di = std::max(i - 1, 0), di_end = std::min(i + 1, resolution - 1); di <= di_end; ++di) {
+          for (int dj = std::max(j - 1, 0), dj_end = std::min(j + 1, resolution - 1); dj <= dj_end; ++dj) {
+            for (int dk = std::max(k - 1, 0), dk_end = std::min(k + 1, resolution - 1); dk <= dk_end; ++dk) {
+              int cell = nearest_cells[(di * resolution + dj) * resolution + dk];
+              if (std::find(candidates.begin(), candidates.end(), cell) == candidates.end())
+                candidates.push_back(cell);
+            }
+          }
+        }
+
+        Eigen::Vector3f center(i + 0.5f, j + 0.5f, k + 0.5f);
+        float min_squared_distance = std::numeric_limits<float>::max();
+        int nearest_seed = -1;
+        for (size_t c = 0, c_end = candidates.size(); c < c_end; ++c) {
+          for (int s = cell_starts[candidates[c]], s_end = cell_starts[candidates[c] + 1]; s < s_end; ++s) {
+            float squared_distance = (seeds[cell_seeds[s]] - center).squaredNorm();
+            if (squared_distance < min_squared_distance) {
+              min_squared_distance = squared_distance;
+              nearest_seed = cell_seeds[s];
+            }
+          }
+        }
+        field[idx] = std::sqrt(min_squared_distance);
+        if (truncated && field[idx] >= truncation) {
+          field[idx] = truncation;
+          nearest_seed = -1;
+        }
+        if (nearest_seeds != nullptr)
+          nearest_seeds[idx] = nearest_seed;
+      }
+    }
+  });
+
+  return;
+}
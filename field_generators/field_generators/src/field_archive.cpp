@@ -0,0 +1,231 @@
+#include <algorithm>
+
+#include "H5Cpp.h"
+
+#ifndef H5_NO_NAMESPACE
+using namespace H5;
+#endif
+
+#include "dense_field.h"
+
+#include "field_archive.h"
+
+FieldArchive::FieldArchive(void) :
+    with_sign_(false), queue_size_(16), closing_(false), failed_(false), field_num_(0) {
+}
+
+FieldArchive::~FieldArchive(void) {
+  close();
+}
+
+static std::string levelSuffix(const std::vector<int>& resolutions, size_t level) {
+  return (level == 0) ? std::string() : "_"+std::to_string(resolutions[level]);
+}
+
+// Extensible along the first dimension, one row per field.
+static void createRowDataSet(H5File& file, const std::string& name, const DataType& data_type, int rank, const hsize_t* row_dims,
+    const hsize_t* chunk_dims, FieldCompression compression, int compression_level) {
+  std::vector<hsize_t> dims(1, 0), max_dims(1, H5S_UNLIMITED), chunks(1, 1);
+  for (int i = 1; i < rank; ++ i) {
+    dims.push_back(row_dims[i-1]);
+    max_dims.push_back(row_dims[i-1]);
+    chunks.push_back(chunk_dims[i-1]);
+  }
+  if (rank == 1)
+    chunks[0] = chunk_dims[0];
+  DataSpace data_space(rank, dims.data(), max_dims.data());
+
+  DSetCreatPropList property_list;
+  property_list.setChunk(rank, chunks.data());
+  DenseField::setCompressionFilter(property_list, compression, compression_level);
+
+  file.createDataSet(name, data_type, data_space, property_list);
+
+  return;
+}
+
+static void writeRow(H5File& file, const std::string& name, int row, const void* buffer, const DataType& mem_type) {
+  DataSet data_set = file.openDataSet(name);
+  DataSpace data_space = data_set.getSpace();
+  int rank = data_space.getSimpleExtentNdims();
+  std::vector<hsize_t> dims(rank);
+  data_space.getSimpleExtentDims(dims.data(), NULL);
+
+  dims[0] = row+1;
+  data_set.extend(dims.data());
+
+  std::vector<hsize_t> offset(rank, 0), count(dims);
+  offset[0] = row;
+  count[0] = 1;
+  DataSpace file_space = data_set.getSpace();
+  file_space.selectHyperslab(H5S_SELECT_SET, count.data(), offset.data());
+  DataSpace mem_space(rank, count.data());
+  data_set.write(buffer, mem_type, mem_space, file_space);
+
+  return;
+}
+
+bool FieldArchive::open(const std::string& filename, const std::vector<int>& resolutions, bool with_sign, FieldCompression compression,
+    int compression_level, int chunk_size, int queue_size) {
+  close();
+  if (resolutions.empty())
+    return false;
+
+  filename_ = filename;
+  resolutions_ = resolutions;
+  with_sign_ = with_sign;
+  queue_size_ = std::max(queue_size, 1);
+  closing_ = false;
+  failed_ = false;
+  field_num_ = 0;
+
+  try {
+    H5File file(filename_, H5F_ACC_TRUNC);
+
+    FloatType data_type(PredType::NATIVE_FLOAT);
+    data_type.setOrder(H5T_ORDER_LE);
+
+    for (size_t i = 0, i_end = resolutions_.size(); i < i_end; ++ i) {
+      std::string suffix = levelSuffix(resolutions_, i);
+      hsize_t resolution = resolutions_[i];
+      hsize_t chunk = (compression == FieldCompression::NONE) ? resolution : std::min(resolution, hsize_t(std::max(chunk_size, 1)));
+      hsize_t row_dims[3] = {resolution, resolution, resolution};
+      hsize_t chunk_dims[3] = {chunk, chunk, chunk};
+      createRowDataSet(file, "DenseField"+suffix, data_type, 4, row_dims, chunk_dims, compression, compression_level);
+      if (with_sign_)
+        createRowDataSet(file, "SignedDenseField"+suffix, data_type, 4, row_dims, chunk_dims, compression, compression_level);
+
+      hsize_t meta_dims[1] = {256};
+      createRowDataSet(file, "Meta"+suffix, data_type, 2, meta_dims, meta_dims, FieldCompression::NONE, 0);
+    }
+
+    hsize_t index_chunk[1] = {1024};
+    createRowDataSet(file, "Labels", PredType::STD_I32LE, 1, NULL, index_chunk, FieldCompression::NONE, 0);
+    createRowDataSet(file, "Names", StrType(PredType::C_S1, H5T_VARIABLE), 1, NULL, index_chunk, FieldCompression::NONE, 0);
+  } catch (FileIException error) {
+    error.printError();
+    return false;
+  } catch (DataSetIException error) {
+    error.printError();
+    return false;
+  } catch (DataSpaceIException error) {
+    error.printError();
+    return false;
+  } catch (DataTypeIException error) {
+    error.printError();
+    return false;
+  } catch (PropListIException error) {
+    error.printError();
+    return false;
+  }
+
+  writer_ = std::thread(&FieldArchive::writeLoop, this);
+
+  return true;
+}
+
+bool FieldArchive::append(const std::vector<DenseField*>& distance_fields, const std::string& name, int label) {
+  if (distance_fields.size() != resolutions_.size())
+    return false;
+
+  Item item;
+  item.name = name;
+  item.label = label;
+  for (size_t i = 0, i_end = distance_fields.size(); i < i_end; ++ i) {
+    DenseField* distance_field = distance_fields[i];
+    QReadLocker locker(&(distance_field->getReadWriteLock()));
+    int resolution = distance_field->getResolution();
+    if (resolution != resolutions_[i])
+      return false;
+
+    int voxel_num = resolution*resolution*resolution;
+    item.values.push_back(std::vector<float>(distance_field->data(), distance_field->data()+voxel_num));
+    if (with_sign_) {
+      std::vector<float> signed_values(voxel_num);
+      for (int x = 0; x < resolution; ++ x)
+        for (int y = 0; y < resolution; ++ y)
+          for (int z = 0; z < resolution; ++ z)
+            signed_values[(x*resolution+y)*resolution+z] = distance_field->signedAt(x, y, z);
+      item.signed_values.push_back(signed_values);
+    }
+
+    std::vector<float> meta(256, 0.0f);
+    double x_min, y_min, z_min;
+    distance_field->getCorner(x_min, y_min, z_min);
+    meta[0] = distance_field->getStep();
+    meta[1] = x_min;
+    meta[2] = y_min;
+    meta[3] = z_min;
+    meta[4] = 1.0f;
+    meta[6] = 1.0f;
+    item.metas.push_back(meta);
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  queue_not_full_.wait(lock, [this]() {return queue_.size() < queue_size_ || failed_ || closing_;});
+  if (failed_ || closing_)
+    return false;
+  queue_.push_back(std::move(item));
+  queue_not_empty_.notify_one();
+
+  return true;
+}
+
+void FieldArchive::writeLoop(void) {
+  try {
+    H5File file(filename_, H5F_ACC_RDWR);
+
+    FloatType data_type(PredType::NATIVE_FLOAT);
+    data_type.setOrder(H5T_ORDER_LE);
+    StrType str_type(PredType::C_S1, H5T_VARIABLE);
+
+    while (true) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      queue_not_empty_.wait(lock, [this]() {return !queue_.empty() || closing_;});
+      if (queue_.empty())
+        break;
+      Item item = std::move(queue_.front());
+      queue_.pop_front();
+      int row = field_num_;
+      lock.unlock();
+      queue_not_full_.notify_one();
+
+      for (size_t i = 0, i_end = resolutions_.size(); i < i_end; ++ i) {
+        std::string suffix = levelSuffix(resolutions_, i);
+        writeRow(file, "DenseField"+suffix, row, item.values[i].data(), data_type);
+        if (with_sign_)
+          writeRow(file, "SignedDenseField"+suffix, row, item.signed_values[i].data(), data_type);
+        writeRow(file, "Meta"+suffix, row, item.metas[i].data(), data_type);
+      }
+      writeRow(file, "Labels", row, &item.label, PredType::NATIVE_INT);
+      const char* name = item.name.c_str();
+      writeRow(file, "Names", row, &name, str_type);
+
+      lock.lock();
+      field_num_ ++;
+    }
+  } catch (Exception error) {
+    error.printError();
+    std::lock_guard<std::mutex> lock(mutex_);
+    failed_ = true;
+    queue_.clear();
+    queue_not_full_.notify_all();
+  }
+
+  return;
+}
+
+bool FieldArchive::close(void) {
+  if (!writer_.joinable())
+    return !failed_;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closing_ = true;
+  }
+  queue_not_empty_.notify_all();
+  queue_not_full_.notify_all();
+  writer_.join();
+
+  return !failed_;
+}
@@ -0,0 +1,186 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+
+#ifdef USE_LMDB
+#include <lmdb.h>
+#endif
+
+#include "dense_field.h"
+
+#include "lmdb_writer.h"
+
+LmdbWriter::LmdbWriter(void) :
+    env_(nullptr), dbi_(0), txn_batch_(1024), record_num_(0) {
+}
+
+LmdbWriter::~LmdbWriter(void) {
+  close();
+}
+
+static void appendVarint(std::string& buffer, uint64_t value) {
+  while (value >= 0x80) {
+    buffer.push_back(char((value & 0x7F) | 0x80));
+    value >>= 7;
+  }
+  buffer.push_back(char(value));
+
+  return;
+}
+
+// Tag of field number with wire type, 0 for varints and 2 for length delimited.
+static void appendTag(std::string& buffer, int field, int wire_type) {
+  appendVarint(buffer, uint64_t((field << 3) | wire_type));
+
+  return;
+}
+
+void LmdbWriter::serializeDatum(const DenseField* distance_field, int label, bool save_float, std::string& datum) {
+  int resolution = distance_field->getResolution();
+  int voxel_num = resolution * resolution * resolution;
+  const float* values = distance_field->data();
+
+  datum.clear();
+  // channels = 1, height = 2, width = 3
+  for (int field = 1; field <= 3; ++ field) {
+    appendTag(datum, field, 0);
+    appendVarint(datum, uint64_t(resolution));
+  }
+
+  if (save_float) {
+    // float_data = 6, packed, which every protobuf parser since 2.3 accepts for repeated floats.
+    appendTag(datum, 6, 2);
+    appendVarint(datum, uint64_t(voxel_num) * sizeof(float));
+    size_t offset = datum.size();
+    datum.resize(offset + voxel_num * sizeof(float));
+    for (int i = 0; i < voxel_num; ++ i) {
+      uint32_t bits;
+      std::memcpy(&bits, &values[i], sizeof(float));
+      for (int b = 0; b < 4; ++ b)
+        datum[offset + 4 * i + b] = char((bits >> (8 * b)) & 0xFF);
+    }
+  } else {
+    // data = 4
+    appendTag(datum, 4, 2);
+    appendVarint(datum, uint64_t(voxel_num));
+    size_t offset = datum.size();
+    datum.resize(offset + voxel_num);
+    for (int i = 0; i < voxel_num; ++ i)
+      datum[offset + i] = char((unsigned char)(std::min(std::max(std::floor(values[i]), 0.0f), 255.0f)));
+  }
+
+  // label = 5, int32, so negative values take ten bytes.
+  appendTag(datum, 5, 0);
+  appendVarint(datum, uint64_t(int64_t(label)));
+
+  return;
+}
+
+bool LmdbWriter::open(const std::string& folder, int txn_batch) {
+  close();
+  txn_batch_ = std::max(txn_batch, 1);
+  record_num_ = 0;
+
+#ifdef USE_LMDB
+  if (!boost::filesystem::exists(folder))
+    boost::filesystem::create_directories(folder);
+
+  if (mdb_env_create(&env_) != MDB_SUCCESS)
+    return false;
+  // Same map size as convert_hdf5_to_lmdb.py, it is only reserved address space.
+  if (mdb_env_set_mapsize(env_, size_t(1e12)) != MDB_SUCCESS || mdb_env_open(env_, folder.c_str(), 0, 0664) != MDB_SUCCESS) {
+    mdb_env_close(env_);
+    env_ = nullptr;
+    return false;
+  }
+
+  MDB_txn* txn = nullptr;
+  MDB_dbi dbi;
+  bool flag = (mdb_txn_begin(env_, NULL, 0, &txn) == MDB_SUCCESS);
+  if (flag && mdb_dbi_open(txn, NULL, 0, &dbi) != MDB_SUCCESS) {
+    mdb_txn_abort(txn);
+    flag = false;
+  }
+  // A failed commit frees the transaction as well.
+  if (flag && mdb_txn_commit(txn) != MDB_SUCCESS)
+    flag = false;
+  if (!flag) {
+    mdb_env_close(env_);
+    env_ = nullptr;
+    return false;
+  }
+  dbi_ = dbi;
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool LmdbWriter::put(const DenseField* distance_field, int index, int label, bool save_float) {
+  std::string datum;
+  {
+    QReadLocker locker(&(const_cast<DenseField*>(distance_field)->getReadWriteLock()));
+    serializeDatum(distance_field, label, save_float, datum);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (env_ == nullptr)
+    return false;
+
+  char key[16];
+  std::snprintf(key, sizeof(key), "%010d", index);
+  pending_.push_back(std::make_pair(std::string(key), std::move(datum)));
+  if (pending_.size() < txn_batch_)
+    return true;
+
+  return commit();
+}
+
+bool LmdbWriter::commit(void) {
+  if (pending_.empty())
+    return true;
+
+#ifdef USE_LMDB
+  MDB_txn* txn = nullptr;
+  if (mdb_txn_begin(env_, NULL, 0, &txn) != MDB_SUCCESS)
+    return false;
+  for (size_t i = 0, i_end = pending_.size(); i < i_end; ++ i) {
+    MDB_val key, value;
+    key.mv_size = pending_[i].first.size();
+    key.mv_data = const_cast<char*>(pending_[i].first.data());
+    value.mv_size = pending_[i].second.size();
+    value.mv_data = const_cast<char*>(pending_[i].second.data());
+    if (mdb_put(txn, dbi_, &key, &value, 0) != MDB_SUCCESS) {
+      mdb_txn_abort(txn);
+      return false;
+    }
+  }
+  if (mdb_txn_commit(txn) != MDB_SUCCESS)
+    return false;
+
+  record_num_ += pending_.size();
+  pending_.clear();
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool LmdbWriter::close(void) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (env_ == nullptr)
+    return true;
+
+  bool flag = commit();
+#ifdef USE_LMDB
+  mdb_dbi_close(env_, dbi_);
+  mdb_env_close(env_);
+#endif
+  env_ = nullptr;
+
+  return flag;
+}
@@ -0,0 +1,27 @@
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include "command_line.h"
+
+// Batch generation only, without the Qt GUI and its dependencies, for servers.
+int main(int argc, char *argv[]) {
+  google::SetUsageMessage("field_generators_cli --df_list=<list> [flags]");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  if (!FLAGS_log_dir.empty()) {
+    if (!boost::filesystem::exists(FLAGS_log_dir)) {
+      boost::filesystem::create_directory(FLAGS_log_dir);
+    }
+  }
+  ::google::InitGoogleLogging("FieldGenerators");
+#ifndef NDEBUG
+  ::google::SetStderrLogging(google::INFO);
+#endif
+
+  if(CommandLine::generateDistanceFields()) {
+    return 0;
+  }
+
+  google::ShowUsageWithFlagsRestrict(argv[0], "command_line");
+  return 1;
+}
@@ -1,7 +1,18 @@
+#include <limits>
+#include <random>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+
 #include <osg/Version>
 
+#include <Eigen/Geometry>
+
 #include "cgal_types.h"
+#include "dense_field.h"
 #include "osg_utility.h"
+#include "triangle_bvh.h"
+#include "stage_profiler.h"
 
 #include "mesh_model.h"
 
@@ -48,15 +59,237 @@ void MeshModel::updateImpl(void) {
   return;
 }
 
-double MeshModel::sampleScan(PclPointCloud::Ptr point_cloud, int resolution, double noise) {
-  osg::ref_ptr < osg::Vec3Array > eye_directions = new osg::Vec3Array;
+void MeshModel::getSampleScanDirections(osg::Vec3Array* eye_directions) {
   osg::ref_ptr < osg::Vec3Array > eye_positions = new osg::Vec3Array;
   OSGUtility::sampleOnSphere(eye_positions, eye_directions, 2);
 
-  return Renderable::virtualScan(eye_directions, resolution, noise, point_cloud);
+  return;
+}
+
+double MeshModel::sampleScan(PclPointCloud::Ptr point_cloud, int resolution, double noise, ScanEngine engine, int thread_num) {
+  osg::ref_ptr < osg::Vec3Array > eye_directions = new osg::Vec3Array;
+  getSampleScanDirections(eye_directions);
+
+  return scan(eye_directions, point_cloud, resolution, noise, engine, thread_num);
+}
+
+// Voxel (x, y, z) packed into 21 bits per axis, for voxels within 2^20 of the origin.
+static uint64_t voxelKey(int64_t x, int64_t y, int64_t z) {
+  return ((uint64_t(x + (1 << 20)) & 0x1FFFFF) << 42) | ((uint64_t(y + (1 << 20)) & 0x1FFFFF) << 21) | (uint64_t(z + (1 << 20)) & 0x1FFFFF);
+}
+
+double MeshModel::sampleScanAdaptive(PclPointCloud::Ptr point_cloud, int resolution, double noise, double min_gain, int max_view_num,
+    int* view_num, ScanEngine engine, int thread_num) {
+  osg::ref_ptr < osg::Vec3Array > candidates = new osg::Vec3Array;
+  getSampleScanDirections(candidates);
+  size_t candidate_num = candidates->size();
+  if (max_view_num <= 0 || size_t(max_view_num) > candidate_num)
+    max_view_num = int(candidate_num);
+
+  // Largest cosine from each candidate to the scanned directions.
+  std::vector<float> closeness(candidate_num, -std::numeric_limits<float>::max());
+  std::vector<bool> scanned(candidate_num, false);
+  std::unordered_set<uint64_t> voxels;
+  std::vector<PclPointCloud::Ptr> point_clouds;
+  osg::ref_ptr < osg::Vec3Array > eye_direction = new osg::Vec3Array(1);
+  double grid_size = -1.0;
+  size_t next = 0;
+  while (point_clouds.size() < size_t(max_view_num)) {
+    eye_direction->at(0) = candidates->at(next);
+    PclPointCloud::Ptr view_cloud(new PclPointCloud);
+    // Noise afterwards, for the coverage, and to draw it as scan() does.
+    grid_size = scan(eye_direction, view_cloud, resolution, 0.0, engine, thread_num);
+    if (grid_size <= 0.0)
+      break;
+    point_clouds.push_back(view_cloud);
+    scanned[next] = true;
+
+    StageTimer coverage_timer("scan_coverage");
+    double voxel_size = grid_size * 2;
+    size_t covered_num = voxels.size();
+    for (size_t i = 0, i_end = view_cloud->size(); i < i_end; ++i) {
+      const PclPoint& point = view_cloud->at(i);
+      voxels.insert(voxelKey(int64_t(std::floor(point.x / voxel_size)), int64_t(std::floor(point.y / voxel_size)),
+          int64_t(std::floor(point.z / voxel_size))));
+    }
+    coverage_timer.stop();
+    if (covered_num != 0 && voxels.size() - covered_num < min_gain * covered_num)
+      break;
+
+    const osg::Vec3 last = candidates->at(next);
+    float farthest = std::numeric_limits<float>::max();
+    for (size_t i = 0; i < candidate_num; ++i) {
+      if (scanned[i])
+        continue;
+      closeness[i] = std::max(closeness[i], candidates->at(i) * last);
+      if (closeness[i] < farthest) {
+        farthest = closeness[i];
+        next = i;
+      }
+    }
+  }
+  if (view_num != nullptr)
+    *view_num = int(point_clouds.size());
+  if (grid_size <= 0.0)
+    return grid_size;
+
+  addScanNoise(point_clouds, noise);
+  point_cloud->clear();
+  for (size_t i = 0, i_end = point_clouds.size(); i < i_end; ++i)
+    *point_cloud += *(point_clouds[i]);
+
+  return grid_size;
+}
+
+void MeshModel::getPlacedTriangles(std::vector<Eigen::Vector3f>& vertices, std::vector<Eigen::Vector3i>& triangles,
+    std::vector<osg::Vec3>& triangle_normals) {
+  QReadLocker locker(&read_write_lock_);
+  getTriangles(vertices, triangles);
+  triangle_normals.clear();
+  triangle_normals.reserve(triangles.size());
+  for (size_t i = 0, i_end = faces_.size(); i < i_end; ++i) {
+    osg::Vec3 normal = face_normals_->at(i);
+    normal.normalize();
+    for (size_t j = 2, j_end = faces_[i].size(); j < j_end; ++j)
+      triangle_normals.push_back(normal);
+  }
+  locker.unlock();
+
+  const osg::Matrix& matrix = getMatrix();
+  if (!matrix.isIdentity()) {
+    for (size_t i = 0, i_end = vertices.size(); i < i_end; ++i) {
+      osg::Vec3 vertex = matrix.preMult(osg::Vec3(vertices[i].x(), vertices[i].y(), vertices[i].z()));
+      vertices[i] = Eigen::Vector3f(vertex.x(), vertex.y(), vertex.z());
+    }
+  }
+
+  return;
+}
+
+double MeshModel::sampleSurface(PclPointCloud::Ptr point_cloud, int point_num, double thinning, int thread_num, unsigned int seed) {
+  StageTimer setup_timer("surface_setup");
+  std::vector<Eigen::Vector3f> vertices;
+  std::vector<Eigen::Vector3i> triangles;
+  std::vector<osg::Vec3> triangle_normals;
+  getPlacedTriangles(vertices, triangles, triangle_normals);
+
+  // Vose's alias method: triangle i is drawn with probability 1/n*(probability[i]), or
+  // its alias otherwise, which sums up to its share of the area.
+  size_t triangle_num = triangles.size();
+  std::vector<double> probabilities(triangle_num);
+  double area = 0.0;
+  for (size_t i = 0; i < triangle_num; ++i) {
+    const Eigen::Vector3i& triangle = triangles[i];
+    Eigen::Vector3f edge_1 = vertices[triangle[1]] - vertices[triangle[0]];
+    Eigen::Vector3f edge_2 = vertices[triangle[2]] - vertices[triangle[0]];
+    probabilities[i] = edge_1.cross(edge_2).norm() / 2;
+    area += probabilities[i];
+  }
+  if (point_num <= 0 || !(area > 0.0))
+    return -1.0;
+
+  std::vector<int> aliases(triangle_num);
+  std::vector<int> small, large;
+  for (size_t i = 0; i < triangle_num; ++i) {
+    aliases[i] = int(i);
+    probabilities[i] *= triangle_num / area;
+    if (probabilities[i] < 1.0)
+      small.push_back(int(i));
+    else
+      large.push_back(int(i));
+  }
+  while (!small.empty() && !large.empty()) {
+    int less = small.back(), more = large.back();
+    small.pop_back();
+    aliases[less] = more;
+    probabilities[more] -= 1.0 - probabilities[less];
+    if (probabilities[more] < 1.0) {
+      large.pop_back();
+      small.push_back(more);
+    }
+  }
+  // What is left over is 1 but for rounding.
+  for (size_t i = 0, i_end = small.size(); i < i_end; ++i)
+    probabilities[small[i]] = 1.0;
+  for (size_t i = 0, i_end = large.size(); i < i_end; ++i)
+    probabilities[large[i]] = 1.0;
+  setup_timer.stop();
+
+  StageTimer sample_timer("surface_sample");
+  const int chunk_size = 1 << 16;
+  int chunk_num = (point_num + chunk_size - 1) / chunk_size;
+  point_cloud->clear();
+  point_cloud->resize(point_num);
+  Common::parallelFor(chunk_num, thread_num, [&](int c, int thread_idx) {
+    std::seed_seq seed_sequence{seed, (unsigned int) (c)};
+    std::mt19937 generator(seed_sequence);
+    std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    PclPoint point;
+    for (int i = c * chunk_size, i_end = std::min(i + chunk_size, point_num); i < i_end; ++i) {
+      double slot = distribution(generator) * triangle_num;
+      size_t t = std::min(size_t(slot), triangle_num - 1);
+      if (slot - t >= probabilities[t])
+        t = aliases[t];
+
+      const Eigen::Vector3i& triangle = triangles[t];
+      float s = std::sqrt(float(distribution(generator)));
+      float r = float(distribution(generator));
+      Eigen::Vector3f position = vertices[triangle[0]] * (1 - s) + vertices[triangle[1]] * (s * (1 - r)) + vertices[triangle[2]] * (s * r);
+      point.x = position.x();
+      point.y = position.y();
+      point.z = position.z();
+      point.normal_x = triangle_normals[t].x();
+      point.normal_y = triangle_normals[t].y();
+      point.normal_z = triangle_normals[t].z();
+      point_cloud->at(i) = point;
+    }
+  });
+  sample_timer.stop();
+
+  double spacing = std::sqrt(area / point_num);
+  if (thinning <= 0.0)
+    return spacing;
+
+  // Hash grid of cells of min_distance, so that closer points are in the same or adjacent
+  // cells. Points are kept in the order they were drawn in.
+  StageTimer thinning_timer("surface_thinning");
+  double min_distance = thinning * spacing;
+  double min_distance_squared = min_distance * min_distance;
+  std::unordered_map<uint64_t, std::vector<int> > cells;
+  size_t kept_num = 0;
+  for (size_t i = 0, i_end = point_cloud->size(); i < i_end; ++i) {
+    const PclPoint& point = point_cloud->at(i);
+    int64_t x = int64_t(std::floor(point.x / min_distance));
+    int64_t y = int64_t(std::floor(point.y / min_distance));
+    int64_t z = int64_t(std::floor(point.z / min_distance));
+    bool close = false;
+    for (int64_t dx = -1; dx <= 1 && !close; ++dx) {
+      for (int64_t dy = -1; dy <= 1 && !close; ++dy) {
+        for (int64_t dz = -1; dz <= 1 && !close; ++dz) {
+          std::unordered_map<uint64_t, std::vector<int> >::const_iterator it = cells.find(voxelKey(x + dx, y + dy, z + dz));
+          if (it == cells.end())
+            continue;
+          for (size_t j = 0, j_end = it->second.size(); j < j_end && !close; ++j) {
+            const PclPoint& kept = point_cloud->at(it->second[j]);
+            double distance_x = kept.x - point.x, distance_y = kept.y - point.y, distance_z = kept.z - point.z;
+            close = (distance_x * distance_x + distance_y * distance_y + distance_z * distance_z < min_distance_squared);
+          }
+        }
+      }
+    }
+    if (close)
+      continue;
+
+    point_cloud->at(kept_num) = point;
+    cells[voxelKey(x, y, z)].push_back(int(kept_num));
+    kept_num++;
+  }
+  point_cloud->resize(kept_num);
+
+  return std::max(spacing, min_distance);
 }
 
-double MeshModel::virtualScan(PclPointCloud::Ptr point_cloud, int resolution, double noise) {
+double MeshModel::virtualScan(PclPointCloud::Ptr point_cloud, int resolution, double noise, ScanEngine engine, int thread_num) {
   osg::Vec3 axis(0.0f, 1.0f, 0.0f);
   osg::Vec3 initial_direction_look_down(-1.0f, -1.0f, 0.0f);
   initial_direction_look_down.normalize();
@@ -70,7 +303,246 @@ double MeshModel::virtualScan(PclPointCloud::Ptr point_cloud, int resolution, do
     eye_directions->push_back(initial_direction_look_up * rotation);
   }
 
-  return Renderable::virtualScan(eye_directions, resolution, noise, point_cloud);
+  return scan(eye_directions, point_cloud, resolution, noise, engine, thread_num);
+}
+
+double MeshModel::scan(const osg::Vec3Array* eye_directions, PclPointCloud::Ptr point_cloud, int resolution, double noise, ScanEngine engine,
+    int thread_num) {
+  if (engine == ScanEngine::OPENGL)
+    return Renderable::virtualScan(eye_directions, resolution, noise, point_cloud, 43.0f, thread_num);
+
+  osg::ref_ptr < osg::Vec3Array > eyes(new osg::Vec3Array);
+  osg::ref_ptr < osg::Vec3Array > centers(new osg::Vec3Array);
+  osg::ref_ptr < osg::Vec3Array > ups(new osg::Vec3Array);
+  getScanViews(eye_directions, eyes, centers, ups);
+
+  std::vector<PclPointCloud::Ptr> point_clouds;
+  for (size_t i = 0, i_end = eyes->size(); i < i_end; ++i)
+    point_clouds.push_back(PclPointCloud::Ptr(new PclPointCloud()));
+
+  double grid_size = 0.0;
+  if (engine == ScanEngine::OPENGL_TILED)
+    grid_size = virtualScanTiled(eyes, centers, ups, resolution, noise, point_clouds, 43.0f, thread_num);
+  else if (engine == ScanEngine::OPENGL_ASYNC)
+    grid_size = virtualScanAsync(eyes, centers, ups, resolution, noise, point_clouds, 43.0f, thread_num);
+  else
+    grid_size = rayCastScan(eyes, centers, ups, resolution, noise, point_clouds, 43.0f, thread_num);
+
+  point_cloud->clear();
+  for (size_t i = 0, i_end = point_clouds.size(); i < i_end; ++i)
+    *point_cloud += *(point_clouds[i]);
+
+  return grid_size;
+}
+
+double MeshModel::rayCastScan(const osg::Vec3Array* eyes, const osg::Vec3Array* centers, const osg::Vec3Array* ups, int resolution, double noise,
+    std::vector<PclPointCloud::Ptr>& point_clouds, float fovy, int thread_num) {
+  StageTimer setup_timer("scan_setup");
+  std::vector<Eigen::Vector3f> vertices;
+  std::vector<Eigen::Vector3i> triangles;
+  std::vector<osg::Vec3> triangle_normals;
+  getPlacedTriangles(vertices, triangles, triangle_normals);
+
+  TriangleBVH bvh;
+  bvh.build(vertices, triangles);
+  setup_timer.stop();
+
+  // Window coordinates (x, y) map to the ray eye+t*(forward+(x-c)*step*side+(y-c)*step*up),
+  // with t the depth along forward. The depth buffer sample of a pixel is taken at its
+  // center, and unprojected at its corner (x, y), which is what is done with t here.
+  size_t view_num = eyes->size();
+  double half_extent = std::tan(fovy / 360.0 * M_PI);
+  double step = 2 * half_extent / resolution;
+  std::vector<std::vector<PclPoint> > columns(view_num * resolution);
+  StageTimer ray_cast_timer("ray_cast");
+  Common::parallelFor(int(view_num * resolution), thread_num, [&](int item, int thread_idx) {
+    int i = item / resolution;
+    int window_x = item % resolution;
+    const osg::Vec3& eye = eyes->at(i);
+    osg::Vec3 eye_direction(centers->at(i) - eye);
+    eye_direction.normalize();
+    osg::Vec3d forward(centers->at(i) - eye);
+    forward.normalize();
+    osg::Vec3d side(forward ^ osg::Vec3d(ups->at(i)));
+    side.normalize();
+    osg::Vec3d up(side ^ forward);
+
+    Eigen::Vector3f origin(eye.x(), eye.y(), eye.z());
+    std::vector<PclPoint>& column = columns[item];
+    PclPoint point;
+    for (int window_y = 0; window_y < resolution; ++window_y) {
+      osg::Vec3d corner = forward + side * (-half_extent + window_x * step) + up * (-half_extent + window_y * step);
+      osg::Vec3d center = corner + (side + up) * (step / 2);
+      float t = 0.0f;
+      // Depth bounds of the rendered scans, setProjectionMatrixAsPerspective(fovy, 1.0f, 1.0f, 10000.0f).
+      int triangle = bvh.intersectRay(origin, Eigen::Vector3f(center.x(), center.y(), center.z()), 1.0f, 10000.0f, t);
+      if (triangle < 0)
+        continue;
+      osg::Vec3 world = osg::Vec3d(eye) + corner * t;
+      point.x = world.x();
+      point.y = world.y();
+      point.z = world.z();
+
+      osg::Vec3 normal = triangle_normals[triangle];
+      if (normal * eye_direction > 0)
+        normal = -normal;
+      normal.normalize();
+      point.normal_x = normal.x();
+      point.normal_y = normal.y();
+      point.normal_z = normal.z();
+      column.push_back(point);
+    }
+  });
+  ray_cast_timer.stop();
+
+  double avg_distance = 0.0;
+  for (size_t i = 0; i < view_num; ++i) {
+    const osg::Vec3& eye = eyes->at(i);
+    osg::Vec3 eye_direction(centers->at(i) - eye);
+    avg_distance += eye_direction.length();
+    eye_direction.normalize();
+
+    PclPointCloud::Ptr point_cloud = point_clouds[i];
+    point_cloud->sensor_origin_ = Eigen::Vector4f(eye.x(), eye.y(), eye.z(), 0.0f);
+    Eigen::Vector3f z_negative(0.0f, 0.0f, -1.0f);
+    point_cloud->sensor_orientation_.setFromTwoVectors(z_negative, Eigen::Vector3f(eye_direction.x(), eye_direction.y(), eye_direction.z()));
+    for (int window_x = 0; window_x < resolution; ++window_x) {
+      const std::vector<PclPoint>& column = columns[i * resolution + window_x];
+      point_cloud->insert(point_cloud->end(), column.begin(), column.end());
+    }
+  }
+  addScanNoise(point_clouds, noise);
+
+  avg_distance /= view_num;
+  double grid_size = avg_distance * tan(fovy / 360.0 * M_PI) * 2 / resolution;
+  return grid_size;
+}
+
+void MeshModel::getTriangles(std::vector<Eigen::Vector3f>& vertices, std::vector<Eigen::Vector3i>& triangles) const {
+  vertices.clear();
+  vertices.reserve(vertices_->size());
+  for (size_t i = 0, i_end = vertices_->size(); i < i_end; ++i) {
+    const osg::Vec3& vertex = vertices_->at(i);
+    vertices.push_back(Eigen::Vector3f(vertex.x(), vertex.y(), vertex.z()));
+  }
+
+  triangles.clear();
+  for (size_t i = 0, i_end = faces_.size(); i < i_end; ++i) {
+    const std::vector<int>& face = faces_[i];
+    for (size_t j = 2, j_end = face.size(); j < j_end; ++j)
+      triangles.push_back(Eigen::Vector3i(face[0], face[j - 1], face[j]));
+  }
+
+  return;
+}
+
+void MeshModel::setTriangles(const std::vector<Eigen::Vector3f>& vertices, const std::vector<Eigen::Vector3i>& triangles) {
+  QWriteLocker locker(&read_write_lock_);
+  expired_ = true;
+
+  vertices_->clear();
+  vertices_->reserve(vertices.size());
+  for (size_t i = 0, i_end = vertices.size(); i < i_end; ++i)
+    vertices_->push_back(osg::Vec3(vertices[i].x(), vertices[i].y(), vertices[i].z()));
+  colors_->assign(vertices_->size(), osg::Vec4(0.8, 0.8, 0.8, 1.0));
+
+  faces_.clear();
+  face_normals_->assign(triangles.size(), osg::Vec3(0.0f, 0.0f, 0.0f));
+  for (size_t i = 0, i_end = triangles.size(); i < i_end; ++i) {
+    const Eigen::Vector3i& t = triangles[i];
+    faces_.push_back(std::vector<int>(t.data(), t.data() + 3));
+    osg::Vec3 vector_0_1(vertices_->at(t[1]) - vertices_->at(t[0]));
+    osg::Vec3 vector_0_2(vertices_->at(t[2]) - vertices_->at(t[0]));
+    face_normals_->at(i) = vector_0_1 ^ vector_0_2;
+    face_normals_->at(i).normalize();
+  }
+
+  return;
+}
+
+bool MeshModel::buildDistanceField(DenseField* distance_field, float truncation, int thread_num, bool with_sign, bool with_normals) {
+  return buildDistanceFields(std::vector<DenseField*>(1, distance_field), truncation, thread_num, with_sign, with_normals);
+}
+
+bool MeshModel::buildDistanceFields(const std::vector<DenseField*>& distance_fields, float truncation, int thread_num, bool with_sign,
+    bool with_normals) {
+  QReadLocker mesh_locker(&read_write_lock_);
+  if (faces_.empty() || distance_fields.empty())
+    return false;
+
+  StageTimer bvh_timer("bvh_build");
+  TriangleBVH bvh;
+  std::vector<Eigen::Vector3f> vertices;
+  std::vector<Eigen::Vector3i> triangles;
+  getTriangles(vertices, triangles);
+  bvh.build(vertices, triangles);
+  mesh_locker.unlock();
+  bvh_timer.stop();
+
+  osg::BoundingBox bbox;
+  for (size_t i = 0, i_end = vertices.size(); i < i_end; ++i)
+    bbox.expandBy(osg::Vec3(vertices[i].x(), vertices[i].y(), vertices[i].z()));
+
+  std::vector<Eigen::Vector3f> triangle_normals;
+  if (with_normals) {
+    triangle_normals.resize(triangles.size());
+    for (size_t i = 0, i_end = triangles.size(); i < i_end; ++i) {
+      const Eigen::Vector3i& t = triangles[i];
+      Eigen::Vector3f normal = (vertices[t[1]] - vertices[t[0]]).cross(vertices[t[2]] - vertices[t[0]]);
+      float length = normal.norm();
+      triangle_normals[i] = (length > 0.0f) ? Eigen::Vector3f(normal / length) : Eigen::Vector3f::Zero();
+    }
+  }
+
+  for (size_t l = 0, l_end = distance_fields.size(); l < l_end; ++l) {
+    DenseField* distance_field = distance_fields[l];
+    QWriteLocker locker(&(distance_field->getReadWriteLock()));
+
+    distance_field->fitBoundingBox(bbox.xMin(), bbox.yMin(), bbox.zMin(), bbox.xMax(), bbox.yMax(), bbox.zMax());
+
+    double x_min, y_min, z_min;
+    distance_field->getCorner(x_min, y_min, z_min);
+    int resolution = distance_field->getResolution();
+    double step = distance_field->getStep();
+
+    distance_field->setSigned(with_sign);
+    distance_field->setWithNormals(with_normals);
+
+    bool truncated = (truncation > 0.0f);
+    float max_distance_squared = truncated ? float(truncation*step*truncation*step) : std::numeric_limits<float>::max();
+
+    // Walk each z row in order, seeding every query with the closest triangle of the
+    // previous voxel, which is at most one step further away than the true distance.
+    StageTimer query_timer("mesh_queries");
+    Common::parallelFor(resolution, thread_num, [&](int i, int t) {
+      Eigen::Vector3f query, closest;
+      query.x() = x_min + i*step + 0.5*step;
+      int triangle = -1;
+      for (int j = 0; j < resolution; ++ j) {
+        query.y() = y_min + j*step + 0.5*step;
+        for (int k = 0; k < resolution; ++ k) {
+          query.z() = z_min + k*step + 0.5*step;
+          float distance_squared = bvh.closestPoint(query, max_distance_squared, triangle, closest);
+          distance_field->at(i, j, k) = (triangle < 0) ? truncation : float(std::sqrt(distance_squared)/step);
+          if (with_normals && triangle >= 0) {
+            float* normal = distance_field->normalAt(i, j, k);
+            normal[0] = triangle_normals[triangle].x();
+            normal[1] = triangle_normals[triangle].y();
+            normal[2] = triangle_normals[triangle].z();
+          }
+          // Either orientation of the mesh counts as inside.
+          if (with_sign)
+            distance_field->insideAt(i, j, k) = (std::abs(bvh.windingNumber(query)) >= 0.5f) ? 1 : 0;
+        }
+      }
+    });
+    query_timer.stop();
+
+    locker.unlock();
+    distance_field->expire();
+  }
+
+  return true;
 }
 
 void MeshModel::savePOVRay(const std::string& filename, osg::Matrix transformation) {
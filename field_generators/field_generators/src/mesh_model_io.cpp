@@ -6,16 +6,17 @@
 #include "file_format_obj.h"
 #include "file_format_off.h"
 #include "file_format_ply.h"
-#include "osg_viewer_widget.h"
+#include "stage_profiler.h"
 
 #include "mesh_model.h"
 
-bool MeshModel::load(const std::string& filename, OSGViewerWidget* osg_viewer_widget) {
+bool MeshModel::load(const std::string& filename) {
   QWriteLocker locker(&read_write_lock_);
   expired_ = true;
 
   if (!boost::filesystem::exists(filename))
     return false;
+  StageTimer timer("load_mesh", double(boost::filesystem::file_size(filename)));
 
   bool flag = false;
   std::string extension = boost::filesystem::path(filename).extension().string();
@@ -26,11 +27,7 @@ bool MeshModel::load(const std::string& filename, OSGViewerWidget* osg_viewer_wi
   } else if (extension == ".ply") {
     flag = readPlyFile(filename);
   }
-
-  locker.unlock();
-  if (flag && osg_viewer_widget != nullptr) {
-    osg_viewer_widget->centerScene();
-  }
+  timer.stop();
 
   return flag;
 }
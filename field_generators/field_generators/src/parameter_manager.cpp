@@ -10,6 +10,7 @@ ParameterManager::ParameterManager(void) :
     dummy_(new DoubleParameter("Dummy Parameter", 0.5, 0.0, 1.0, 0.01)),
     sample_scan_resolution_(new IntParameter("Sample Scan Resolution", 100, 64, 1024, 32)),
     distance_field_resolution_(new IntParameter("Distance Field Resolution", 100, 64, 1024, 32)),
+    distance_field_truncation_(new DoubleParameter("Distance Field Truncation", 0.0, 0.0, 128.0, 1.0)),
     virtual_scan_resolution_(new IntParameter("Virtual Scan Resolution", 200, 128, 2048, 64)),
     virtual_scan_noise_(new DoubleParameter("Virtual Scan Noise", 0.0, 0.0, 0.04, 0.001)),
     normal_estimation_radius_(new DoubleParameter("Normal Estimation Radius", 0.10, 0.01, 0.5, 0.01)),
@@ -55,13 +56,19 @@ int ParameterManager::getDistanceFieldResolution(void) const {
   return *distance_field_resolution_;
 }
 
-bool ParameterManager::getDistanceFieldParameters(int& distance_field_resolution) {
+double ParameterManager::getDistanceFieldTruncation(void) const {
+  return *distance_field_truncation_;
+}
+
+bool ParameterManager::getDistanceFieldParameters(int& distance_field_resolution, double& distance_field_truncation) {
   ParameterDialog parameter_dialog("Distance Field Resolution", MainWindow::getInstance());
   parameter_dialog.addParameter(distance_field_resolution_.get());
+  parameter_dialog.addParameter(distance_field_truncation_.get());
   if (!parameter_dialog.exec() == QDialog::Accepted)
     return false;
 
   distance_field_resolution = *distance_field_resolution_;
+  distance_field_truncation = *distance_field_truncation_;
 
   return true;
 }
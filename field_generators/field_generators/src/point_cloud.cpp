@@ -15,6 +15,8 @@
 #include "cgal_types.h"
 #include "osg_utility.h"
 #include "dense_field.h"
+#include "stage_profiler.h"
+#include "distance_transform.h"
 
 #include "point_cloud.h"
 
@@ -41,6 +43,7 @@ void PointCloud::setSensorInformation(const osg::Vec3& eye, const osg::Vec3& dir
 bool PointCloud::load(const std::string& filename) {
   if (!boost::filesystem::exists(filename))
     return false;
+  StageTimer timer("load_point_cloud", double(boost::filesystem::file_size(filename)));
 
   QWriteLocker locker(&read_write_lock_);
   expired_ = true;
@@ -55,12 +58,14 @@ bool PointCloud::load(const std::string& filename) {
     success = (pcl::io::loadOBJFile(filename, *data_) == 0);
 
   setMatrix(osg::Matrix::identity());
+  timer.stop();
   buildTree();
 
   return success;
 }
 
 void PointCloud::buildTree(void) {
+  StageTimer timer("build_tree");
   if (!data_->empty())
     tree_->setInputCloud(data_);
 
@@ -70,6 +75,7 @@ void PointCloud::buildTree(void) {
 bool PointCloud::save(const std::string& filename) {
   if (data_->empty())
     return false;
+  StageTimer timer("save_point_cloud", double(data_->size()*sizeof(PclPoint)));
 
   QReadLocker locker(&read_write_lock_);
 
@@ -79,10 +85,10 @@ bool PointCloud::save(const std::string& filename) {
   if (getMatrix().isIdentity()) {
     if (extension == ".pcd") {
       pcl::PCDWriter pcd_writer;
-      success = (pcd_writer.writeBinaryCompressed < PclPoint > (filename, *data_) != 0);
+      success = (pcd_writer.writeBinaryCompressed < PclPoint > (filename, *data_) == 0);
     } else if (extension == ".ply") {
       pcl::PLYWriter ply_writer;
-      success = (ply_writer.write < PclPoint > (filename, *data_, true) != 0);
+      success = (ply_writer.write < PclPoint > (filename, *data_, true) == 0);
     }
   } else {
     Eigen::Matrix4d transformation = PclMatrixCaster<osg::Matrix>(getMatrix());
@@ -90,10 +96,10 @@ bool PointCloud::save(const std::string& filename) {
     pcl::transformPointCloudWithNormals(*data_, *data_transformed, transformation);
     if (extension == ".pcd") {
       pcl::PCDWriter pcd_writer;
-      success = (pcd_writer.writeBinaryCompressed < PclPoint > (filename, *data_transformed) != 0);
+      success = (pcd_writer.writeBinaryCompressed < PclPoint > (filename, *data_transformed) == 0);
     } else if (extension == ".ply") {
       pcl::PLYWriter ply_writer;
-      success = (ply_writer.write < PclPoint > (filename, *data_transformed, true) != 0);
+      success = (ply_writer.write < PclPoint > (filename, *data_transformed, true) == 0);
     }
   }
 
@@ -261,6 +267,7 @@ void PointCloud::flipAllNormals(void) {
 }
 
 void PointCloud::voxelGridFilter(double grid_size, bool use_original_points) {
+  StageTimer timer("voxel_filter");
   QWriteLocker locker(&read_write_lock_);
   expired_ = true;
 
@@ -278,60 +285,170 @@ std::string PointCloud::getInformation(void) const {
   return Common::int2String(data_->size() / 1000, 5) + "K Points\n";
 }
 
-bool PointCloud::buildDistanceField(DenseField* distance_field) {
-  QWriteLocker locker(&(distance_field->getReadWriteLock()));
+static void computeVoxelSeeds(const DenseField* distance_field, PclPointCloud::Ptr points, std::vector<Eigen::Vector3f>& seeds) {
+  double x_min, y_min, z_min;
+  distance_field->getCorner(x_min, y_min, z_min);
+  double scale = 1.0/distance_field->getStep();
 
-  PclPoint min_pt, max_pt;
-  pcl::getMinMax3D(*data_, min_pt, max_pt);
+  seeds.clear();
+  seeds.reserve(points->size());
+  for (size_t i = 0, i_end = points->size(); i < i_end; ++ i) {
+    const PclPoint& point = points->at(i);
+    seeds.push_back(Eigen::Vector3f((point.x-x_min)*scale, (point.y-y_min)*scale, (point.z-z_min)*scale));
+  }
+
+  return;
+}
 
-  double x_center = (min_pt.x+max_pt.x)/2;
-  double y_center = (min_pt.y+max_pt.y)/2;
-  double z_center = (min_pt.z+max_pt.z)/2;
+static void copyNormal(const PclPoint& point, float* normal) {
+  float length = std::sqrt(point.normal_x*point.normal_x + point.normal_y*point.normal_y + point.normal_z*point.normal_z);
+  if (!std::isfinite(length) || length == 0) {
+    normal[0] = normal[1] = normal[2] = 0;
+    return;
+  }
 
-  double padding_scale = 1.25;
-  double x_range = max_pt.x-min_pt.x;
-  double y_range = max_pt.y-min_pt.y;
-  double z_range = max_pt.z-min_pt.z;
-  double range = padding_scale*std::max(x_range, std::max(y_range, z_range));
+  normal[0] = point.normal_x/length;
+  normal[1] = point.normal_y/length;
+  normal[2] = point.normal_z/length;
 
-  double x_min = x_center-range/2;
-  double y_min = y_center-range/2;
-  double z_min = z_center-range/2;
-  distance_field->setCorner(x_min, y_min, z_min);
+  return;
+}
 
-  int resolution = distance_field->getResolution();
-  double step = range/resolution;
-  distance_field->setStep(step);
+bool PointCloud::buildDistanceField(DenseField* distance_field, DistanceFieldEngine engine, float truncation, int thread_num,
+    bool with_normals) {
+  return buildDistanceFields(std::vector<DenseField*>(1, distance_field), engine, truncation, thread_num, with_normals);
+}
 
-  // Build a potentially sparser search tree for computing distance field
+bool PointCloud::buildDistanceFields(const std::vector<DenseField*>& distance_fields, DistanceFieldEngine engine, float truncation,
+    int thread_num, bool with_normals) {
+  if (distance_fields.empty())
+    return false;
+
+  PclPoint min_pt, max_pt;
+  pcl::getMinMax3D(*data_, min_pt, max_pt);
+  double step = std::numeric_limits<double>::max();
+  for (size_t i = 0, i_end = distance_fields.size(); i < i_end; ++ i) {
+    QWriteLocker locker(&(distance_fields[i]->getReadWriteLock()));
+    distance_fields[i]->fitBoundingBox(min_pt.x, min_pt.y, min_pt.z, max_pt.x, max_pt.y, max_pt.z);
+    step = std::min(step, distance_fields[i]->getStep());
+  }
+
+  // Build a potentially sparser search tree for computing distance field,
+  // dense enough for the finest level
   double grid_size = step/2;
+  StageTimer filter_timer("field_voxel_filter");
   pcl::VoxelGrid<PclPoint> voxel_grid;
   voxel_grid.setDownsampleAllData(true);
   voxel_grid.setInputCloud(data_);
   voxel_grid.setLeafSize(grid_size, grid_size, grid_size);
   PclPointCloud::Ptr data_filtered(new PclPointCloud);
   voxel_grid.filter(*data_filtered);
-  PclSearchTree::Ptr search_tree(new pcl::search::FlannSearch<PclPoint>());
-  search_tree->setInputCloud(data_filtered); 
+  filter_timer.stop();
 
-  double scale = resolution/range;
-  std::vector<int> neighbor_indices(1);
-  std::vector<float> neighbor_distances(1);
-  PclPoint query;
-  for (int i = 0; i < resolution; ++ i) {
+  PclSearchTree::Ptr search_tree;
+  if (engine == DistanceFieldEngine::KD_TREE) {
+    StageTimer timer("flann_build");
+    search_tree.reset(new pcl::search::FlannSearch<PclPoint>());
+    search_tree->setInputCloud(data_filtered);
+  }
+
+  for (size_t i = 0, i_end = distance_fields.size(); i < i_end; ++ i) {
+    DenseField* distance_field = distance_fields[i];
+    QWriteLocker locker(&(distance_field->getReadWriteLock()));
+    distance_field->setWithNormals(with_normals);
+    switch (engine) {
+    case DistanceFieldEngine::KD_TREE: {
+      StageTimer timer("kdtree_queries");
+      buildDistanceFieldKdTree(distance_field, data_filtered, search_tree, truncation, thread_num);
+      break;
+    }
+    case DistanceFieldEngine::EDT: {
+      StageTimer timer("edt");
+      buildDistanceFieldEDT(distance_field, data_filtered, truncation, thread_num);
+      break;
+    }
+    }
+    locker.unlock();
+    distance_field->expire();
+  }
+
+  return true;
+}
+
+void PointCloud::buildDistanceFieldKdTree(DenseField* distance_field, PclPointCloud::Ptr data_filtered, PclSearchTree::Ptr search_tree,
+    float truncation, int thread_num) {
+  double x_min, y_min, z_min;
+  distance_field->getCorner(x_min, y_min, z_min);
+  int resolution = distance_field->getResolution();
+  double step = distance_field->getStep();
+  double scale = 1.0/step;
+
+  // Voxels more than ceil(truncation) cells away from every occupied cell are at
+  // least ceil(truncation)+0.5 voxels away from every point, so they take the
+  // clamp value without a query.
+  bool truncated = (truncation > 0.0f);
+  std::vector<char> band;
+  if (truncated) {
+    std::vector<Eigen::Vector3f> seeds;
+    computeVoxelSeeds(distance_field, data_filtered, seeds);
+    DistanceTransform::rasterize(seeds, resolution, band);
+    DistanceTransform::dilate(band, resolution, int(std::ceil(truncation)));
+  }
+
+  // One x slab per work item, with per-thread query buffers.
+  thread_num = std::max(thread_num, 1);
+  std::vector<std::vector<int> > neighbor_indices_per_thread(thread_num, std::vector<int>(1));
+  std::vector<std::vector<float> > neighbor_distances_per_thread(thread_num, std::vector<float>(1));
+  Common::parallelFor(resolution, thread_num, [&](int i, int t) {
+    std::vector<int>& neighbor_indices = neighbor_indices_per_thread[t];
+    std::vector<float>& neighbor_distances = neighbor_distances_per_thread[t];
+    PclPoint query;
     query.x = x_min + i*step + 0.5*step;
     for (int j = 0; j < resolution; ++ j) {
       query.y = y_min + j*step + 0.5*step;
       for (int k = 0; k < resolution; ++ k) {
+        if (truncated && !band[(i*resolution+j)*resolution+k]) {
+          distance_field->at(i, j, k) = truncation;
+          continue;
+        }
         query.z = z_min + k*step + 0.5*step;
         search_tree->nearestKSearch(query, 1, neighbor_indices, neighbor_distances);
         distance_field->at(i, j, k) = std::sqrt(neighbor_distances[0])*scale;
+        if (truncated && distance_field->at(i, j, k) >= truncation) {
+          distance_field->at(i, j, k) = truncation;
+          continue;
+        }
+        if (distance_field->hasNormals())
+          copyNormal(data_filtered->at(neighbor_indices[0]), distance_field->normalAt(i, j, k));
       }
     }
+  });
+
+  return;
+}
+
+void PointCloud::buildDistanceFieldEDT(DenseField* distance_field, PclPointCloud::Ptr data_filtered, float truncation, int thread_num) {
+  // Seeds in continuous voxel coordinates, so the field comes out in voxel units as well.
+  std::vector<Eigen::Vector3f> seeds;
+  computeVoxelSeeds(distance_field, data_filtered, seeds);
+
+  if (!distance_field->hasNormals()) {
+    DistanceTransform::compute(seeds, distance_field->getResolution(), distance_field->data(), truncation, thread_num);
+    return;
   }
 
-  locker.unlock();
-  distance_field->expire();
+  int resolution = distance_field->getResolution();
+  std::vector<int> nearest_seeds(resolution*resolution*resolution);
+  DistanceTransform::compute(seeds, resolution, distance_field->data(), truncation, thread_num, nearest_seeds.data());
+  for (int i = 0; i < resolution; ++ i) {
+    for (int j = 0; j < resolution; ++ j) {
+      for (int k = 0; k < resolution; ++ k) {
+        int nearest_seed = nearest_seeds[(i*resolution+j)*resolution+k];
+        if (nearest_seed >= 0)
+          copyNormal(data_filtered->at(nearest_seed), distance_field->normalAt(i, j, k));
+      }
+    }
+  }
 
-  return true;
+  return;
 }
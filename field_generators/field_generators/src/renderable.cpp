@@ -1,26 +1,24 @@
+#include <chrono>
 #include <random>
-
-#include <QMenu>
-#include <QImage>
-#include <QColor>
-#include <QCursor>
+#include <thread>
+#include <algorithm>
 
 #include <osg/Point>
 #include <osg/Geode>
 #include <osg/StateSet>
 #include <osg/Material>
-#include <osgViewer/Viewer>
+#include <osgDB/WriteFile>
 #include <osgUtil/UpdateVisitor>
 #include <osg/ComputeBoundsVisitor>
 
 #include "osg_utility.h"
+#include "scan_context.h"
+#include "stage_profiler.h"
 #include "update_callback.h"
 #include "force_update_visitor.h"
 
 #include "renderable.h"
 
-std::mutex Renderable::mutex_graphics_context_;
-
 Renderable::Renderable(void) :
     read_write_lock_(QReadWriteLock::NonRecursive), content_root_(new osg::MatrixTransform), expired_(true), hidden_(false) {
   addChild(content_root_);
@@ -96,18 +94,22 @@ static void saveColorImage(osg::Image* color_image, osg::Image* depth_image, con
   int height = color_image->t();
   float* z_buffer = (float*) (depth_image->data());
 
-  QImage q_image(width, height, QImage::Format_ARGB32);
+  osg::ref_ptr<osg::Image> image = new osg::Image;
+  image->allocateImage(width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE);
   for (int x = 0; x < width; ++x) {
     for (int y = 0; y < height; ++y) {
       float z = z_buffer[y * width + x];
       osg::Vec4 color = color_image->getColor(x, y);
       color = color * 255;
-      QRgb rgba = QColor(color.r(), color.g(), color.b(), (z == 1.0) ? (0) : (255)).rgba();
-      q_image.setPixel(x, height - 1 - y, rgba);
+      unsigned char* rgba = image->data(x, y);
+      rgba[0] = (unsigned char) (color.r());
+      rgba[1] = (unsigned char) (color.g());
+      rgba[2] = (unsigned char) (color.b());
+      rgba[3] = (z == 1.0) ? (0) : (255);
     }
   }
 
-  q_image.save(filename.c_str());
+  osgDB::writeImageFile(*image, filename);
 
   return;
 }
@@ -131,64 +133,120 @@ static void saveDepthImage(osg::Image* depth_image, const std::string& filename)
     }
   }
 
-  QImage q_image(width, height, QImage::Format_ARGB32);
+  osg::ref_ptr<osg::Image> image = new osg::Image;
+  image->allocateImage(width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE);
   for (size_t x = 0; x < width; ++x) {
     for (size_t y = 0; y < height; ++y) {
       float z = z_buffer[y * width + x];
       float value = (z == 1.0) ? (1.0) : (z - z_min) * 0.8 / (z_max - z_min);
       value *= 255;
-      QRgb rgba = QColor(value, value, value, (z == 1.0) ? (0) : (255)).rgba();
-      q_image.setPixel(x, height - 1 - y, rgba);
+      unsigned char* rgba = image->data(x, y);
+      rgba[0] = rgba[1] = rgba[2] = (unsigned char) (value);
+      rgba[3] = (z == 1.0) ? (0) : (255);
+    }
+  }
+
+  osgDB::writeImageFile(*image, filename);
+
+  return;
+}
+
+// Points of the pixels of the width x height view at (x_offset, y_offset) of the buffers
+// that the scan covers, column by column, as the noise is drawn in that order. Points
+// are counted first, so that the buffers can be walked row by row, in blocks of rows on
+// thread_num threads, straight into the place of each point. The unprojection is that of
+// osg::Matrix::preMult, operation by operation, on four pixels at a time, and the normals
+// are read from the float color buffer directly, so the points are the same as those of
+// unprojecting pixel by pixel with the osg accessors.
+static void unprojectView(const osg::Image* depth_image, const osg::Image* color_image, int x_offset, int y_offset, int width, int height,
+    const osg::Matrix& matrix_vpw_inverse, const osg::Vec3& eye_direction, PclPointCloud& point_cloud, int thread_num) {
+  int buffer_width = depth_image->s();
+  const float* z_buffer = (const float*) (depth_image->data());
+  int block_rows = std::max(height / (4 * std::max(thread_num, 1)), 1);
+  int block_num = (height + block_rows - 1) / block_rows;
+
+  std::vector<int> offsets(block_num * width, 0);
+  Common::parallelFor(block_num, thread_num, [&](int b, int thread_idx) {
+    int* counts = &offsets[b * width];
+    for (int y = b * block_rows, y_end = std::min(y + block_rows, height); y < y_end; ++y) {
+      const float* depth_row = z_buffer + (y_offset + y) * buffer_width + x_offset;
+      for (int x = 0; x < width; ++x)
+        counts[x] += (depth_row[x] != 1.0f) ? 1 : 0;
+    }
+  });
+  size_t point_num = 0;
+  for (int x = 0; x < width; ++x) {
+    for (int b = 0; b < block_num; ++b) {
+      int count = offsets[b * width + x];
+      offsets[b * width + x] = int(point_num);
+      point_num += count;
     }
   }
+  size_t start = point_cloud.size();
+  point_cloud.resize(start + point_num);
+
+  const double* m = matrix_vpw_inverse.ptr();
+  Common::parallelFor(block_num, thread_num, [&](int b, int thread_idx) {
+    int* cursors = &offsets[b * width];
+    PclPoint point;
+    for (int y = b * block_rows, y_end = std::min(y + block_rows, height); y < y_end; ++y) {
+      const float* depth_row = z_buffer + (y_offset + y) * buffer_width + x_offset;
+      const float* color_row = (const float*) (color_image->data(x_offset, y_offset + y));
+      double window_y = y;
+      double w_y = m[7] * window_y, x_y = m[4] * window_y, y_y = m[5] * window_y, z_y = m[6] * window_y;
+      for (int x = 0; x < width; x += 4) {
+        int n = std::min(width - x, 4);
+        bool covered = false;
+        Eigen::Array4d window_x, window_z;
+        for (int k = 0; k < 4; ++k) {
+          window_x[k] = x + k;
+          window_z[k] = (k < n) ? depth_row[x + k] : 1.0f;
+          covered = covered || (window_z[k] != 1.0);
+        }
+        if (!covered)
+          continue;
 
-  q_image.save(filename.c_str());
+        Eigen::Array4d d = 1.0 / (m[3] * window_x + w_y + m[11] * window_z + m[15]);
+        Eigen::Array4d world_x = (m[0] * window_x + x_y + m[8] * window_z + m[12]) * d;
+        Eigen::Array4d world_y = (m[1] * window_x + y_y + m[9] * window_z + m[13]) * d;
+        Eigen::Array4d world_z = (m[2] * window_x + z_y + m[10] * window_z + m[14]) * d;
+        for (int k = 0; k < n; ++k) {
+          if (window_z[k] == 1.0)
+            continue;
+          point.x = float(world_x[k]);
+          point.y = float(world_y[k]);
+          point.z = float(world_z[k]);
+
+          const float* color = color_row + 4 * (x + k);
+          osg::Vec3 normal(color[0], color[1], color[2]);
+          normal = normal * 2 - osg::Vec3(1.0f, 1.0f, 1.0f);
+          if (normal * eye_direction > 0)
+            normal = -normal;
+          normal.normalize();
+          point.normal_x = normal.x();
+          point.normal_y = normal.y();
+          point.normal_z = normal.z();
+          point_cloud[start + (cursors[x + k]++)] = point;
+        }
+      }
+    }
+  });
 
   return;
 }
 
 double Renderable::virtualScan(const osg::Vec3Array* eyes, const osg::Vec3Array* centers, const osg::Vec3Array* ups, int resolution, double noise,
-    std::vector<pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr>& point_clouds, float fovy) {
-  bool with_noise = (noise != 0.0);
-  std::default_random_engine generator;
-  std::normal_distribution<double> distribution(0.0, with_noise ? (noise / 2) : (0.00000001));
-
-  osg::ref_ptr < osg::GraphicsContext::Traits > traits = new osg::GraphicsContext::Traits;
-  traits->x = 0;
-  traits->y = 0;
-  traits->width = resolution;
-  traits->height = resolution;
-  traits->windowDecoration = false;
-  traits->doubleBuffer = false;
-  traits->sharedContext = 0;
-  traits->pbuffer = true;
-
-  mutex_graphics_context_.lock();
-  osg::ref_ptr < osg::GraphicsContext > graphics_context = osg::GraphicsContext::createGraphicsContext(traits.get());
-  mutex_graphics_context_.unlock();
-
-  osgViewer::Viewer* viewer = new osgViewer::Viewer;
-  osg::ref_ptr < osg::Camera > camera = viewer->getCamera();
-  camera->setGraphicsContext(graphics_context);
-  camera->setViewport(new osg::Viewport(0, 0, resolution, resolution));
+    std::vector<pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr>& point_clouds, float fovy, int thread_num) {
+  StageTimer setup_timer("scan_setup");
+  ScanContext* scan_context = ScanContext::acquire(resolution, resolution);
+  if (scan_context == nullptr)
+    return -1.0;
+  osg::Camera* camera = scan_context->getCamera();
   camera->setProjectionMatrixAsPerspective(fovy, 1.0f, 1.0f, 10000.0f);
-  camera->setClearColor(osg::Vec4(1, 1, 1, 1.0));
-
-  osg::ref_ptr < osg::Group > node = new osg::Group;
-  OSGUtility::applyShaderNormal (node);
-  node->getOrCreateStateSet()->setMode(GL_DEPTH_TEST, osg::StateAttribute::ON);
-  node->addChild(this);
-  viewer->setSceneData(node);
-  viewer->setDataVariance(osg::Object::DYNAMIC);
-  viewer->setThreadingModel(osgViewer::Viewer::SingleThreaded);
-  viewer->realize();
-
-  osg::ref_ptr < osg::Image > color_image = new osg::Image;
-  osg::ref_ptr < osg::Image > depth_image = new osg::Image;
-  color_image->allocateImage(traits->width, traits->height, 1, GL_RGBA, GL_FLOAT);
-  depth_image->allocateImage(traits->width, traits->height, 1, GL_DEPTH_COMPONENT, GL_FLOAT);
-  camera->attach(osg::Camera::COLOR_BUFFER, color_image.get());
-  camera->attach(osg::Camera::DEPTH_BUFFER, depth_image.get());
+  osg::Image* color_image = scan_context->getColorImage();
+  osg::Image* depth_image = scan_context->getDepthImage();
+  scan_context->setScene(this);
+  setup_timer.stop();
 
   double avg_distance = 0.0;
   for (size_t i = 0, i_end = eyes->size(); i < i_end; ++i) {
@@ -199,50 +257,28 @@ double Renderable::virtualScan(const osg::Vec3Array* eyes, const osg::Vec3Array*
     avg_distance += eye_direction.length();
     eye_direction.normalize();
     camera->setViewMatrixAsLookAt(eye, center, up);
-    viewer->frame();
+    StageTimer render_timer("render", double(depth_image->getTotalSizeInBytes()+color_image->getTotalSizeInBytes()));
+    scan_context->frame();
+    render_timer.stop();
 
-    //saveDepthImage(depth_image.get(), "depth.png");
-    //saveColorImage(color_image.get(), depth_image.get(), "color.png");
+    //saveDepthImage(depth_image, "depth.png");
+    //saveColorImage(color_image, depth_image, "color.png");
 
     osg::Matrix matrix_vpw(camera->getViewMatrix() * camera->getProjectionMatrix());
     matrix_vpw.postMult(camera->getViewport()->computeWindowMatrix());
     osg::Matrix matrix_vpw_inverse;
     matrix_vpw_inverse.invert(matrix_vpw);
 
+    StageTimer unproject_timer("unproject");
     pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr point_cloud = point_clouds[i];
     point_cloud->sensor_origin_ = Eigen::Vector4f(eye.x(), eye.y(), eye.z(), 0.0f);
     Eigen::Vector3f z_negative(0.0f, 0.0f, -1.0f);
     point_cloud->sensor_orientation_.setFromTwoVectors(z_negative, Eigen::Vector3f(eye_direction.x(), eye_direction.y(), eye_direction.z()));
-    pcl::PointXYZRGBNormal point;
-    float* z_buffer = (float*) (depth_image->data());
-    for (size_t window_x = 0; window_x < resolution; ++window_x) {
-      for (size_t window_y = 0; window_y < resolution; ++window_y) {
-        double window_z = z_buffer[window_y * resolution + window_x];
-        if (window_z == 1.0)
-          continue;
-        osg::Vec3 world = osg::Vec3(window_x, window_y, window_z) * matrix_vpw_inverse;
-
-        point.x = world.x() + (with_noise ? (distribution(generator)) : (0.0));
-        point.y = world.y() + (with_noise ? (distribution(generator)) : (0.0));
-        point.z = world.z() + (with_noise ? (distribution(generator)) : (0.0));
-
-        osg::Vec4 normal_4 = color_image->getColor(window_x, window_y);
-        osg::Vec3 normal(normal_4.x(), normal_4.y(), normal_4.z());
-        normal = normal * 2 - osg::Vec3(1.0f, 1.0f, 1.0f);
-        if (normal * eye_direction > 0)
-          normal = -normal;
-        normal.normalize();
-        point.normal_x = normal.x();
-        point.normal_y = normal.y();
-        point.normal_z = normal.z();
-        point_cloud->push_back(point);
-      }
-    }
+    unprojectView(depth_image, color_image, 0, 0, resolution, resolution, matrix_vpw_inverse, eye_direction, *point_cloud, thread_num);
   }
 
-  mutex_graphics_context_.lock();
-  delete viewer;
-  mutex_graphics_context_.unlock();
+  scan_context->setScene(nullptr);
+  addScanNoise(point_clouds, noise);
 
   avg_distance /= eyes->size();
   double grid_size = avg_distance * tan(fovy / 360.0 * M_PI) * 2 / resolution;
@@ -250,106 +286,257 @@ double Renderable::virtualScan(const osg::Vec3Array* eyes, const osg::Vec3Array*
 }
 
 double Renderable::virtualScan(const osg::Vec3& eye, const osg::Vec3& center, const osg::Vec3& up, int width, int height, double noise,
-    pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr point_cloud, float fovy) {
-  bool with_noise = (noise != 0.0);
-  std::default_random_engine generator;
-  std::normal_distribution<double> distribution(0.0, with_noise ? (noise / 2) : (0.00000001));
-
-  osg::ref_ptr < osg::GraphicsContext::Traits > traits = new osg::GraphicsContext::Traits;
-  traits->x = 0;
-  traits->y = 0;
-  traits->width = width;
-  traits->height = height;
-  traits->windowDecoration = false;
-  traits->doubleBuffer = false;
-  traits->sharedContext = 0;
-  traits->pbuffer = true;
-
-  mutex_graphics_context_.lock();
-  osg::ref_ptr < osg::GraphicsContext > graphics_context = osg::GraphicsContext::createGraphicsContext(traits.get());
-  mutex_graphics_context_.unlock();
-
-  osgViewer::Viewer* viewer = new osgViewer::Viewer;
-  osg::ref_ptr < osg::Camera > camera = viewer->getCamera();
-  camera->setGraphicsContext(graphics_context);
-  camera->setViewport(new osg::Viewport(0, 0, width, height));
+    pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr point_cloud, float fovy, int thread_num) {
+  StageTimer setup_timer("scan_setup");
+  ScanContext* scan_context = ScanContext::acquire(width, height);
+  if (scan_context == nullptr)
+    return -1.0;
+  osg::Camera* camera = scan_context->getCamera();
   camera->setProjectionMatrixAsPerspective(fovy, 1.0f * width / height, 1.0f, 10000.0f);
-  camera->setClearColor(osg::Vec4(1, 1, 1, 1.0));
-
-  osg::ref_ptr < osg::Group > node = new osg::Group;
-  OSGUtility::applyShaderNormal (node);
-  node->getOrCreateStateSet()->setMode(GL_DEPTH_TEST, osg::StateAttribute::ON);
-  node->addChild(this);
-  viewer->setSceneData(node);
-  viewer->setDataVariance(osg::Object::DYNAMIC);
-  viewer->setThreadingModel(osgViewer::Viewer::SingleThreaded);
-  viewer->realize();
-
-  osg::ref_ptr < osg::Image > color_image = new osg::Image;
-  osg::ref_ptr < osg::Image > depth_image = new osg::Image;
-  color_image->allocateImage(traits->width, traits->height, 1, GL_RGBA, GL_FLOAT);
-  depth_image->allocateImage(traits->width, traits->height, 1, GL_DEPTH_COMPONENT, GL_FLOAT);
-  camera->attach(osg::Camera::COLOR_BUFFER, color_image.get());
-  camera->attach(osg::Camera::DEPTH_BUFFER, depth_image.get());
+  osg::Image* color_image = scan_context->getColorImage();
+  osg::Image* depth_image = scan_context->getDepthImage();
+  scan_context->setScene(this);
+  setup_timer.stop();
 
   osg::Vec3 eye_direction(center - eye);
   double avg_distance = eye_direction.length();
   eye_direction.normalize();
   camera->setViewMatrixAsLookAt(eye, center, up);
-  viewer->frame();
+  StageTimer render_timer("render", double(depth_image->getTotalSizeInBytes()+color_image->getTotalSizeInBytes()));
+  scan_context->frame();
+  render_timer.stop();
 
-  //saveDepthImage(depth_image.get(), "depth.png");
-  //saveColorImage(color_image.get(), depth_image.get(), "color.png");
+  //saveDepthImage(depth_image, "depth.png");
+  //saveColorImage(color_image, depth_image, "color.png");
 
   osg::Matrix matrix_vpw(camera->getViewMatrix() * camera->getProjectionMatrix());
   matrix_vpw.postMult(camera->getViewport()->computeWindowMatrix());
   osg::Matrix matrix_vpw_inverse;
   matrix_vpw_inverse.invert(matrix_vpw);
 
+  StageTimer unproject_timer("unproject");
   point_cloud->sensor_origin_ = Eigen::Vector4f(eye.x(), eye.y(), eye.z(), 0.0f);
   Eigen::Vector3f z_negative(0.0f, 0.0f, -1.0f);
   point_cloud->sensor_orientation_.setFromTwoVectors(z_negative, Eigen::Vector3f(eye_direction.x(), eye_direction.y(), eye_direction.z()));
-  pcl::PointXYZRGBNormal point;
-  float* z_buffer = (float*) (depth_image->data());
-  for (size_t window_x = 0; window_x < width; ++window_x) {
-    for (size_t window_y = 0; window_y < height; ++window_y) {
-      double window_z = z_buffer[window_y * width + window_x];
-      if (window_z == 1.0)
-        continue;
-      osg::Vec3 world = osg::Vec3(window_x, window_y, window_z) * matrix_vpw_inverse;
-
-      point.x = world.x() + (with_noise ? (distribution(generator)) : (0.0));
-      point.y = world.y() + (with_noise ? (distribution(generator)) : (0.0));
-      point.z = world.z() + (with_noise ? (distribution(generator)) : (0.0));
-
-      osg::Vec4 normal_4 = color_image->getColor(window_x, window_y);
-      osg::Vec3 normal(normal_4.x(), normal_4.y(), normal_4.z());
-      normal = normal * 2 - osg::Vec3(1.0f, 1.0f, 1.0f);
-      if (normal * eye_direction > 0)
-        normal = -normal;
-      normal.normalize();
-      point.normal_x = normal.x();
-      point.normal_y = normal.y();
-      point.normal_z = normal.z();
-      point_cloud->push_back(point);
+  unprojectView(depth_image, color_image, 0, 0, width, height, matrix_vpw_inverse, eye_direction, *point_cloud, thread_num);
+  std::vector<PclPointCloud::Ptr> point_clouds(1, point_cloud);
+  addScanNoise(point_clouds, noise);
+  unproject_timer.stop();
+
+  scan_context->setScene(nullptr);
+
+  double grid_size = avg_distance * tan(fovy / 360.0 * M_PI) * 2 / (std::max(width, height));
+  return grid_size;
+}
+
+double Renderable::virtualScanTiled(const osg::Vec3Array* eyes, const osg::Vec3Array* centers, const osg::Vec3Array* ups, int resolution,
+    double noise, std::vector<PclPointCloud::Ptr>& point_clouds, float fovy, int thread_num) {
+  // Keep the framebuffer within what pbuffers commonly support.
+  const int max_framebuffer_size = 4096;
+
+  osg::BoundingBox local_bbox = getBoundingBox();
+  osg::BoundingBox bbox;
+  for (int i = 0; i < 8; ++i)
+    bbox.expandBy(local_bbox.corner(i) * getMatrix());
+
+  size_t view_num = eyes->size();
+  size_t tiles_per_side = std::max(max_framebuffer_size / resolution, 1);
+  osg::ref_ptr<osg::Viewport> tile_viewport = new osg::Viewport(0, 0, resolution, resolution);
+  for (size_t batch_start = 0; batch_start < view_num; batch_start += tiles_per_side * tiles_per_side) {
+    StageTimer setup_timer("scan_setup");
+    size_t batch_size = std::min(tiles_per_side * tiles_per_side, view_num - batch_start);
+    int columns = int(std::ceil(std::sqrt(double(batch_size))));
+    int rows = int((batch_size + columns - 1) / columns);
+    ScanContext* scan_context = ScanContext::acquire(columns * resolution, rows * resolution);
+    if (scan_context == nullptr)
+      return -1.0;
+
+    // A camera per tile, drawing this node into its part of the framebuffer, which the
+    // camera of the context clears once for all of them.
+    osg::ref_ptr<osg::Group> tiles = new osg::Group;
+    std::vector<osg::Matrix> matrices_vpw_inverse(batch_size);
+    for (size_t j = 0; j < batch_size; ++j) {
+      const osg::Vec3& eye = eyes->at(batch_start + j);
+      double distance = (bbox.center() - eye).length();
+      double z_far = distance + bbox.radius() * 1.01;
+      double z_near = std::max(distance - bbox.radius() * 1.01, z_far * 1e-4);
+
+      osg::ref_ptr<osg::Camera> camera = new osg::Camera;
+      camera->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
+      camera->setRenderOrder(osg::Camera::NESTED_RENDER);
+      camera->setClearMask(0);
+      camera->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
+      camera->setViewport(new osg::Viewport((j % columns) * resolution, (j / columns) * resolution, resolution, resolution));
+      camera->setProjectionMatrixAsPerspective(fovy, 1.0f, z_near, z_far);
+      camera->setViewMatrixAsLookAt(eye, centers->at(batch_start + j), ups->at(batch_start + j));
+      camera->addChild(this);
+      tiles->addChild(camera);
+
+      osg::Matrix matrix_vpw(camera->getViewMatrix() * camera->getProjectionMatrix());
+      matrix_vpw.postMult(tile_viewport->computeWindowMatrix());
+      matrices_vpw_inverse[j].invert(matrix_vpw);
     }
+    scan_context->setScene(tiles);
+    osg::Image* color_image = scan_context->getColorImage();
+    osg::Image* depth_image = scan_context->getDepthImage();
+    setup_timer.stop();
+
+    StageTimer render_timer("render", double(depth_image->getTotalSizeInBytes()+color_image->getTotalSizeInBytes()));
+    scan_context->frame();
+    render_timer.stop();
+
+    StageTimer unproject_timer("unproject");
+    Common::parallelFor(int(batch_size), thread_num, [&](int j, int thread_idx) {
+      size_t i = batch_start + j;
+      const osg::Vec3& eye = eyes->at(i);
+      osg::Vec3 eye_direction(centers->at(i) - eye);
+      eye_direction.normalize();
+
+      PclPointCloud::Ptr point_cloud = point_clouds[i];
+      point_cloud->sensor_origin_ = Eigen::Vector4f(eye.x(), eye.y(), eye.z(), 0.0f);
+      Eigen::Vector3f z_negative(0.0f, 0.0f, -1.0f);
+      point_cloud->sensor_orientation_.setFromTwoVectors(z_negative, Eigen::Vector3f(eye_direction.x(), eye_direction.y(), eye_direction.z()));
+      unprojectView(depth_image, color_image, (j % columns) * resolution, (j / columns) * resolution, resolution, resolution,
+          matrices_vpw_inverse[j], eye_direction, *point_cloud, 1);
+    });
+    unproject_timer.stop();
+
+    scan_context->setScene(nullptr);
   }
 
-  mutex_graphics_context_.lock();
-  delete viewer;
-  mutex_graphics_context_.unlock();
+  addScanNoise(point_clouds, noise);
 
-  double grid_size = avg_distance * tan(fovy / 360.0 * M_PI) * 2 / (std::max(width, height));
+  double avg_distance = 0.0;
+  for (size_t i = 0; i < view_num; ++i)
+    avg_distance += (centers->at(i) - eyes->at(i)).length();
+  avg_distance /= view_num;
+  double grid_size = avg_distance * tan(fovy / 360.0 * M_PI) * 2 / resolution;
+  return grid_size;
+}
+
+double Renderable::virtualScanAsync(const osg::Vec3Array* eyes, const osg::Vec3Array* centers, const osg::Vec3Array* ups, int resolution,
+    double noise, std::vector<PclPointCloud::Ptr>& point_clouds, float fovy, int thread_num) {
+  StageTimer setup_timer("scan_setup");
+  ScanContext* scan_context = ScanContext::acquire(resolution, resolution, true);
+  if (scan_context == nullptr)
+    return virtualScan(eyes, centers, ups, resolution, noise, point_clouds, fovy, thread_num);
+  osg::Camera* camera = scan_context->getCamera();
+  camera->setProjectionMatrixAsPerspective(fovy, 1.0f, 1.0f, 10000.0f);
+  // One pair read back into while the view in the other is unprojected.
+  osg::ref_ptr<osg::Image> color_images[2];
+  osg::ref_ptr<osg::Image> depth_images[2];
+  for (int k = 0; k < 2; ++k) {
+    color_images[k] = new osg::Image;
+    color_images[k]->allocateImage(resolution, resolution, 1, GL_RGBA, GL_FLOAT);
+    depth_images[k] = new osg::Image;
+    depth_images[k]->allocateImage(resolution, resolution, 1, GL_DEPTH_COMPONENT, GL_FLOAT);
+  }
+  double image_bytes = double(depth_images[0]->getTotalSizeInBytes()+color_images[0]->getTotalSizeInBytes());
+  scan_context->setScene(this);
+  setup_timer.stop();
+
+  size_t view_num = eyes->size();
+  std::vector<osg::Matrix> matrices_vpw_inverse(view_num);
+  std::vector<osg::Vec3> eye_directions(view_num);
+  std::thread unprojecting;
+  std::chrono::steady_clock::time_point unproject_start, unproject_end;
+  // The samples are recorded here rather than on the unprojecting threads, which come
+  // and go with the views.
+  auto joinUnprojecting = [&]() {
+    if (!unprojecting.joinable())
+      return;
+    std::chrono::steady_clock::time_point wait_start = std::chrono::steady_clock::now();
+    unprojecting.join();
+    StageProfiler* stage_profiler = StageProfiler::getInstance();
+    if (stage_profiler->isEnabled()) {
+      stage_profiler->record("unproject", unproject_start, unproject_end, 0.0);
+      stage_profiler->record("unproject_overlap", unproject_start, std::max(unproject_start, std::min(unproject_end, wait_start)), 0.0);
+    }
+  };
+
+  bool read_back = true;
+  for (size_t i = 0; i <= view_num && read_back; ++i) {
+    // View i is rendered while view i-1 is read back and unprojected.
+    if (i < view_num) {
+      const osg::Vec3& eye = eyes->at(i);
+      eye_directions[i] = centers->at(i) - eye;
+      eye_directions[i].normalize();
+      camera->setViewMatrixAsLookAt(eye, centers->at(i), ups->at(i));
+      StageTimer render_timer("render", image_bytes);
+      scan_context->frame();
+      render_timer.stop();
+
+      osg::Matrix matrix_vpw(camera->getViewMatrix() * camera->getProjectionMatrix());
+      matrix_vpw.postMult(camera->getViewport()->computeWindowMatrix());
+      matrices_vpw_inverse[i].invert(matrix_vpw);
+    }
+    if (i == 0)
+      continue;
+
+    size_t j = i - 1;
+    joinUnprojecting();
+    StageTimer readback_timer("readback", image_bytes);
+    read_back = scan_context->readBack(color_images[j % 2], depth_images[j % 2]);
+    readback_timer.stop();
+    if (!read_back)
+      break;
+
+    unprojecting = std::thread([&, j]() {
+      unproject_start = std::chrono::steady_clock::now();
+      const osg::Vec3& eye = eyes->at(j);
+      const osg::Vec3& eye_direction = eye_directions[j];
+      PclPointCloud::Ptr point_cloud = point_clouds[j];
+      point_cloud->sensor_origin_ = Eigen::Vector4f(eye.x(), eye.y(), eye.z(), 0.0f);
+      Eigen::Vector3f z_negative(0.0f, 0.0f, -1.0f);
+      point_cloud->sensor_orientation_.setFromTwoVectors(z_negative, Eigen::Vector3f(eye_direction.x(), eye_direction.y(), eye_direction.z()));
+      unprojectView(depth_images[j % 2], color_images[j % 2], 0, 0, resolution, resolution, matrices_vpw_inverse[j], eye_direction, *point_cloud,
+          thread_num);
+      unproject_end = std::chrono::steady_clock::now();
+    });
+  }
+  joinUnprojecting();
+
+  scan_context->setScene(nullptr);
+  if (!read_back) {
+    for (size_t i = 0; i < view_num; ++i)
+      point_clouds[i]->clear();
+    return -1.0;
+  }
+  addScanNoise(point_clouds, noise);
+
+  double avg_distance = 0.0;
+  for (size_t i = 0; i < view_num; ++i)
+    avg_distance += (centers->at(i) - eyes->at(i)).length();
+  avg_distance /= view_num;
+  double grid_size = avg_distance * tan(fovy / 360.0 * M_PI) * 2 / resolution;
   return grid_size;
 }
 
+void Renderable::addScanNoise(std::vector<PclPointCloud::Ptr>& point_clouds, double noise) {
+  if (noise == 0.0)
+    return;
+
+  std::default_random_engine generator;
+  std::normal_distribution<double> distribution(0.0, noise / 2);
+  for (size_t i = 0, i_end = point_clouds.size(); i < i_end; ++i) {
+    for (size_t j = 0, j_end = point_clouds[i]->size(); j < j_end; ++j) {
+      PclPoint& point = point_clouds[i]->at(j);
+      point.x = point.x + distribution(generator);
+      point.y = point.y + distribution(generator);
+      point.z = point.z + distribution(generator);
+    }
+  }
+
+  return;
+}
+
 double Renderable::virtualScan(const osg::Vec3Array* eyes, const osg::Vec3Array* centers, const osg::Vec3Array* ups, int resolution, double noise,
-    pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr point_cloud, float fovy) {
+    pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr point_cloud, float fovy, int thread_num) {
   std::vector < pcl::PointCloud < pcl::PointXYZRGBNormal > ::Ptr > point_clouds;
   for (size_t i = 0, i_end = eyes->size(); i < i_end; ++i)
     point_clouds.push_back(pcl::PointCloud < pcl::PointXYZRGBNormal > ::Ptr(new pcl::PointCloud<pcl::PointXYZRGBNormal>()));
 
-  double grid_size = virtualScan(eyes, centers, ups, resolution, noise, point_clouds, fovy);
+  double grid_size = virtualScan(eyes, centers, ups, resolution, noise, point_clouds, fovy, thread_num);
 
   point_cloud->clear();
   for (size_t i = 0, i_end = point_clouds.size(); i < i_end; ++i)
@@ -358,32 +545,39 @@ double Renderable::virtualScan(const osg::Vec3Array* eyes, const osg::Vec3Array*
   return grid_size;
 }
 
-double Renderable::virtualScan(const osg::Vec3Array* eye_directions, int resolution, double noise,
-    std::vector<pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr>& point_clouds, float fovy) {
+void Renderable::getScanViews(const osg::Vec3Array* eye_directions, osg::Vec3Array* eyes, osg::Vec3Array* centers, osg::Vec3Array* ups) {
   osg::BoundingBox bbox = getBoundingBox();
   osg::Vec3 center = bbox.center();
   osg::Vec3 up(0.0, 1.0, 0.0);
   double distance = bbox.radius() * 2.5;
 
-  osg::ref_ptr < osg::Vec3Array > eyes(new osg::Vec3Array);
-  osg::ref_ptr < osg::Vec3Array > centers(new osg::Vec3Array);
-  osg::ref_ptr < osg::Vec3Array > ups(new osg::Vec3Array);
+  eyes->clear();
   eyes->reserve(eye_directions->size());
   centers->assign(eye_directions->size(), center);
   ups->assign(eye_directions->size(), up);
   for (size_t i = 0, i_end = eye_directions->size(); i < i_end; ++i)
     eyes->push_back(center - eye_directions->at(i) * distance);
 
-  return virtualScan(eyes, centers, ups, resolution, noise, point_clouds, fovy);
+  return;
+}
+
+double Renderable::virtualScan(const osg::Vec3Array* eye_directions, int resolution, double noise,
+    std::vector<pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr>& point_clouds, float fovy, int thread_num) {
+  osg::ref_ptr < osg::Vec3Array > eyes(new osg::Vec3Array);
+  osg::ref_ptr < osg::Vec3Array > centers(new osg::Vec3Array);
+  osg::ref_ptr < osg::Vec3Array > ups(new osg::Vec3Array);
+  getScanViews(eye_directions, eyes, centers, ups);
+
+  return virtualScan(eyes, centers, ups, resolution, noise, point_clouds, fovy, thread_num);
 }
 
 double Renderable::virtualScan(const osg::Vec3Array* eye_directions, int resolution, double noise, pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr point_cloud,
-    float fovy) {
+    float fovy, int thread_num) {
   std::vector < pcl::PointCloud < pcl::PointXYZRGBNormal > ::Ptr > point_clouds;
   for (size_t i = 0, i_end = eye_directions->size(); i < i_end; ++i)
     point_clouds.push_back(pcl::PointCloud < pcl::PointXYZRGBNormal > ::Ptr(new pcl::PointCloud<pcl::PointXYZRGBNormal>()));
 
-  double grid_size = virtualScan(eye_directions, resolution, noise, point_clouds, fovy);
+  double grid_size = virtualScan(eye_directions, resolution, noise, point_clouds, fovy, thread_num);
 
   point_cloud->clear();
   for (size_t i = 0, i_end = point_clouds.size(); i < i_end; ++i)
@@ -0,0 +1,250 @@
+#include <map>
+#include <tuple>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <utility>
+
+#include <osg/BufferObject>
+#include <osg/GLExtensions>
+#include <osg/GraphicsContext>
+
+#include "osg_utility.h"
+
+#include "scan_context.h"
+
+std::mutex ScanContext::mutex_graphics_context_;
+
+namespace {
+  typedef std::tuple<int, int, bool> ScanContextKey;
+
+  struct ThreadScanContexts {
+    size_t use_count = 0;
+    std::map<ScanContextKey, std::unique_ptr<ScanContext> > contexts;
+  };
+
+  ThreadScanContexts& getThreadScanContexts(void) {
+    static thread_local ThreadScanContexts thread_scan_contexts;
+    return thread_scan_contexts;
+  }
+}
+
+// Buffer objects are GL 1.5, and have to be looked up at run time.
+struct ScanContext::PixelBuffers {
+  typedef void (GL_APIENTRY * GenBuffersProc)(GLsizei n, GLuint* buffers);
+  typedef void (GL_APIENTRY * DeleteBuffersProc)(GLsizei n, const GLuint* buffers);
+  typedef void (GL_APIENTRY * BindBufferProc)(GLenum target, GLuint buffer);
+  typedef void (GL_APIENTRY * BufferDataProc)(GLenum target, std::ptrdiff_t size, const GLvoid* data, GLenum usage);
+  typedef GLvoid* (GL_APIENTRY * MapBufferProc)(GLenum target, GLenum access);
+  typedef GLboolean (GL_APIENTRY * UnmapBufferProc)(GLenum target);
+
+  GenBuffersProc gen_buffers = nullptr;
+  DeleteBuffersProc delete_buffers = nullptr;
+  BindBufferProc bind_buffer = nullptr;
+  BufferDataProc buffer_data = nullptr;
+  MapBufferProc map_buffer = nullptr;
+  UnmapBufferProc unmap_buffer = nullptr;
+
+  // Each holds the depth buffer of a frame, followed by its color buffer.
+  GLuint buffers[2] = {0, 0};
+  size_t depth_size = 0;
+  size_t color_size = 0;
+  // The buffer the next frame is read into, and the number of frames read into buffers
+  // but not read back yet, the oldest of which is in the other buffer if there are two.
+  int next = 0;
+  int pending = 0;
+};
+
+class ScanContext::ReadbackCallback : public osg::Camera::DrawCallback {
+public:
+  ReadbackCallback(ScanContext* scan_context) :
+      scan_context_(scan_context) {
+  }
+
+  virtual void operator()(osg::RenderInfo& render_info) const {
+    scan_context_->readPixels();
+  }
+
+private:
+  ScanContext* scan_context_;
+};
+
+ScanContext::ScanContext(void) :
+    width_(0), height_(0), last_use_(0) {
+}
+
+ScanContext::~ScanContext(void) {
+  if (!viewer_.valid())
+    return;
+
+  std::lock_guard<std::mutex> lock(mutex_graphics_context_);
+  osg::GraphicsContext* graphics_context = viewer_->getCamera()->getGraphicsContext();
+  if (pixel_buffers_ && pixel_buffers_->buffers[0] != 0 && graphics_context->makeCurrent()) {
+    pixel_buffers_->delete_buffers(2, pixel_buffers_->buffers);
+    graphics_context->releaseContext();
+  }
+  root_ = nullptr;
+  viewer_ = nullptr;
+}
+
+bool ScanContext::createPixelBuffers(osg::GraphicsContext* graphics_context) {
+  pixel_buffers_.reset(new PixelBuffers);
+  PixelBuffers& pixel_buffers = *pixel_buffers_;
+  pixel_buffers.depth_size = size_t(width_) * height_ * sizeof(GLfloat);
+  pixel_buffers.color_size = size_t(width_) * height_ * 4 * sizeof(GLfloat);
+
+  if (!graphics_context->makeCurrent())
+    return false;
+  bool supported = osg::setGLExtensionFuncPtr(pixel_buffers.gen_buffers, "glGenBuffers", "glGenBuffersARB")
+      && osg::setGLExtensionFuncPtr(pixel_buffers.delete_buffers, "glDeleteBuffers", "glDeleteBuffersARB")
+      && osg::setGLExtensionFuncPtr(pixel_buffers.bind_buffer, "glBindBuffer", "glBindBufferARB")
+      && osg::setGLExtensionFuncPtr(pixel_buffers.buffer_data, "glBufferData", "glBufferDataARB")
+      && osg::setGLExtensionFuncPtr(pixel_buffers.map_buffer, "glMapBuffer", "glMapBufferARB")
+      && osg::setGLExtensionFuncPtr(pixel_buffers.unmap_buffer, "glUnmapBuffer", "glUnmapBufferARB");
+  if (supported) {
+    pixel_buffers.gen_buffers(2, pixel_buffers.buffers);
+    for (int i = 0; i < 2; ++i) {
+      pixel_buffers.bind_buffer(GL_PIXEL_PACK_BUFFER_ARB, pixel_buffers.buffers[i]);
+      pixel_buffers.buffer_data(GL_PIXEL_PACK_BUFFER_ARB, std::ptrdiff_t(pixel_buffers.depth_size + pixel_buffers.color_size), nullptr,
+          GL_STREAM_READ_ARB);
+    }
+    pixel_buffers.bind_buffer(GL_PIXEL_PACK_BUFFER_ARB, 0);
+  }
+  graphics_context->releaseContext();
+
+  return supported;
+}
+
+bool ScanContext::create(int width, int height, bool async_readback) {
+  width_ = width;
+  height_ = height;
+
+  osg::ref_ptr < osg::GraphicsContext::Traits > traits = new osg::GraphicsContext::Traits;
+  traits->x = 0;
+  traits->y = 0;
+  traits->width = width;
+  traits->height = height;
+  traits->windowDecoration = false;
+  traits->doubleBuffer = false;
+  traits->sharedContext = 0;
+  traits->pbuffer = true;
+
+  std::lock_guard<std::mutex> lock(mutex_graphics_context_);
+  osg::ref_ptr < osg::GraphicsContext > graphics_context = osg::GraphicsContext::createGraphicsContext(traits.get());
+  // No pbuffer on this display (or no display at all).
+  if (!graphics_context.valid())
+    return false;
+
+  viewer_ = new osgViewer::Viewer;
+  osg::ref_ptr < osg::Camera > camera = viewer_->getCamera();
+  camera->setGraphicsContext(graphics_context);
+  camera->setViewport(new osg::Viewport(0, 0, width, height));
+  camera->setClearColor(osg::Vec4(1, 1, 1, 1.0));
+
+  root_ = new osg::Group;
+  OSGUtility::applyShaderNormal(root_);
+  root_->getOrCreateStateSet()->setMode(GL_DEPTH_TEST, osg::StateAttribute::ON);
+  viewer_->setSceneData(root_);
+  viewer_->setDataVariance(osg::Object::DYNAMIC);
+  viewer_->setThreadingModel(osgViewer::Viewer::SingleThreaded);
+  viewer_->realize();
+
+  color_image_ = new osg::Image;
+  depth_image_ = new osg::Image;
+  color_image_->allocateImage(width, height, 1, GL_RGBA, GL_FLOAT);
+  depth_image_->allocateImage(width, height, 1, GL_DEPTH_COMPONENT, GL_FLOAT);
+  if (!async_readback) {
+    camera->attach(osg::Camera::COLOR_BUFFER, color_image_.get());
+    camera->attach(osg::Camera::DEPTH_BUFFER, depth_image_.get());
+  } else {
+    if (!viewer_->isRealized() || !createPixelBuffers(graphics_context))
+      return false;
+    camera->setFinalDrawCallback(new ReadbackCallback(this));
+  }
+
+  return viewer_->isRealized();
+}
+
+ScanContext* ScanContext::acquire(int width, int height, bool async_readback) {
+  ThreadScanContexts& thread_scan_contexts = getThreadScanContexts();
+  std::map<ScanContextKey, std::unique_ptr<ScanContext> >& contexts = thread_scan_contexts.contexts;
+
+  ScanContextKey key(width, height, async_readback);
+  std::map<ScanContextKey, std::unique_ptr<ScanContext> >::iterator it = contexts.find(key);
+  if (it == contexts.end()) {
+    // Sizes come and go in the GUI, which scans at the size of its window.
+    if (contexts.size() >= max_contexts_per_thread_) {
+      std::map<ScanContextKey, std::unique_ptr<ScanContext> >::iterator oldest = contexts.begin();
+      for (it = contexts.begin(); it != contexts.end(); ++it) {
+        if (it->second->last_use_ < oldest->second->last_use_)
+          oldest = it;
+      }
+      contexts.erase(oldest);
+    }
+
+    std::unique_ptr<ScanContext> scan_context(new ScanContext);
+    if (!scan_context->create(width, height, async_readback))
+      return nullptr;
+    it = contexts.insert(std::make_pair(key, std::move(scan_context))).first;
+  }
+
+  it->second->last_use_ = ++thread_scan_contexts.use_count;
+  return it->second.get();
+}
+
+void ScanContext::release(void) {
+  getThreadScanContexts().contexts.clear();
+
+  return;
+}
+
+void ScanContext::setScene(osg::Node* scene) {
+  root_->removeChildren(0, root_->getNumChildren());
+  if (scene != nullptr)
+    root_->addChild(scene);
+
+  return;
+}
+
+void ScanContext::readPixels(void) {
+  PixelBuffers& pixel_buffers = *pixel_buffers_;
+  pixel_buffers.bind_buffer(GL_PIXEL_PACK_BUFFER_ARB, pixel_buffers.buffers[pixel_buffers.next]);
+  glReadPixels(0, 0, width_, height_, GL_DEPTH_COMPONENT, GL_FLOAT, (GLvoid*) (0));
+  glReadPixels(0, 0, width_, height_, GL_RGBA, GL_FLOAT, (GLvoid*) (pixel_buffers.depth_size));
+  pixel_buffers.bind_buffer(GL_PIXEL_PACK_BUFFER_ARB, 0);
+
+  pixel_buffers.next = 1 - pixel_buffers.next;
+  pixel_buffers.pending = std::min(pixel_buffers.pending + 1, 2);
+
+  return;
+}
+
+bool ScanContext::readBack(osg::Image* color_image, osg::Image* depth_image) {
+  if (!pixel_buffers_ || pixel_buffers_->pending == 0)
+    return false;
+
+  PixelBuffers& pixel_buffers = *pixel_buffers_;
+  int buffer = (pixel_buffers.pending == 2) ? pixel_buffers.next : (1 - pixel_buffers.next);
+  pixel_buffers.pending--;
+
+  osg::GraphicsContext* graphics_context = getCamera()->getGraphicsContext();
+  if (!graphics_context->makeCurrent()) {
+    pixel_buffers.pending = 0;
+    return false;
+  }
+  // Waits for the frame, not for those rendered after it.
+  pixel_buffers.bind_buffer(GL_PIXEL_PACK_BUFFER_ARB, pixel_buffers.buffers[buffer]);
+  const unsigned char* data = (const unsigned char*) (pixel_buffers.map_buffer(GL_PIXEL_PACK_BUFFER_ARB, GL_READ_ONLY_ARB));
+  if (data != nullptr) {
+    std::memcpy(depth_image->data(), data, pixel_buffers.depth_size);
+    std::memcpy(color_image->data(), data + pixel_buffers.depth_size, pixel_buffers.color_size);
+    pixel_buffers.unmap_buffer(GL_PIXEL_PACK_BUFFER_ARB);
+  }
+  pixel_buffers.bind_buffer(GL_PIXEL_PACK_BUFFER_ARB, 0);
+  graphics_context->releaseContext();
+  if (data == nullptr)
+    pixel_buffers.pending = 0;
+
+  return data != nullptr;
+}
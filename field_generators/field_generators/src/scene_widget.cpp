@@ -215,11 +215,12 @@ void SceneWidget::slotBuildDistanceField(void) {
   MainWindow* main_window = MainWindow::getInstance();
 
   int resolution;
-  if (!ParameterManager::getInstance().getDistanceFieldParameters(resolution))
+  double truncation;
+  if (!ParameterManager::getInstance().getDistanceFieldParameters(resolution, truncation))
     return;
 
   osg::ref_ptr<DenseField> distance_field(new DenseField(resolution));
-  point_cloud_->buildDistanceField(distance_field);
+  point_cloud_->buildDistanceField(distance_field, DistanceFieldEngine::KD_TREE, truncation, boost::thread::hardware_concurrency());
 
   removeSceneChild(distance_field_);
   distance_field_ = distance_field;
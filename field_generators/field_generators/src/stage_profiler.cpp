@@ -0,0 +1,192 @@
+#include <map>
+#include <cmath>
+#include <tuple>
+#include <limits>
+#include <fstream>
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+
+#include "singleton.h"
+
+#include "stage_profiler.h"
+
+StageProfiler* StageProfiler::getInstance(void) {
+  return Singleton<StageProfiler>::instance();
+}
+
+StageProfiler::StageProfiler(void) :
+    enabled_(false), origin_(std::chrono::steady_clock::now()) {
+}
+
+StageProfiler::ThreadBuffer* StageProfiler::getThreadBuffer(void) {
+  static thread_local ThreadBuffer* thread_buffer = nullptr;
+  if (thread_buffer == nullptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    thread_buffers_.push_back(std::unique_ptr<ThreadBuffer>(new ThreadBuffer));
+    thread_buffer = thread_buffers_.back().get();
+    thread_buffer->thread_idx = int(thread_buffers_.size())-1;
+  }
+  return thread_buffer;
+}
+
+void StageProfiler::record(const char* stage, const std::chrono::steady_clock::time_point& start,
+    const std::chrono::steady_clock::time_point& end, double bytes) {
+  Sample sample;
+  sample.stage = stage;
+  sample.start = std::chrono::duration_cast<std::chrono::nanoseconds>(start-origin_).count();
+  sample.duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end-start).count();
+  sample.bytes = bytes;
+  getThreadBuffer()->samples.push_back(sample);
+
+  return;
+}
+
+namespace {
+  struct StageStatistics {
+    int count;
+    double busy_seconds;
+    double mean_ms;
+    double p50_ms;
+    double p90_ms;
+    double p99_ms;
+    double max_ms;
+    double span_seconds;
+    double items_per_second;
+    double bytes;
+    double bytes_per_second;
+  };
+
+  // Nearest rank percentile of sorted durations.
+  double percentile(const std::vector<int64_t>& durations, double p) {
+    size_t rank = size_t(std::ceil(p/100*durations.size()));
+    return durations[std::min(std::max(rank, size_t(1)), durations.size())-1]/1e6;
+  }
+
+  // Samples as (start, duration, bytes), in nanoseconds.
+  StageStatistics computeStatistics(const std::vector<std::tuple<int64_t, int64_t, double> >& samples) {
+    StageStatistics statistics;
+    std::vector<int64_t> durations;
+    int64_t first_start = std::numeric_limits<int64_t>::max(), last_end = 0, busy = 0;
+    statistics.bytes = 0.0;
+    for (size_t i = 0, i_end = samples.size(); i < i_end; ++ i) {
+      int64_t start = std::get<0>(samples[i]), duration = std::get<1>(samples[i]);
+      durations.push_back(duration);
+      busy += duration;
+      first_start = std::min(first_start, start);
+      last_end = std::max(last_end, start+duration);
+      statistics.bytes += std::get<2>(samples[i]);
+    }
+    std::sort(durations.begin(), durations.end());
+
+    statistics.count = int(samples.size());
+    statistics.busy_seconds = busy/1e9;
+    statistics.mean_ms = busy/1e6/samples.size();
+    statistics.p50_ms = percentile(durations, 50);
+    statistics.p90_ms = percentile(durations, 90);
+    statistics.p99_ms = percentile(durations, 99);
+    statistics.max_ms = durations.back()/1e6;
+    statistics.span_seconds = (last_end-first_start)/1e9;
+    statistics.items_per_second = (statistics.span_seconds > 0.0) ? (statistics.count/statistics.span_seconds) : 0.0;
+    statistics.bytes_per_second = (statistics.span_seconds > 0.0) ? (statistics.bytes/statistics.span_seconds) : 0.0;
+    return statistics;
+  }
+
+  void writeJson(std::ostream& out, const StageStatistics& s) {
+    out << "\"count\": " << s.count << ", \"busy_seconds\": " << s.busy_seconds << ", \"mean_ms\": " << s.mean_ms
+        << ", \"p50_ms\": " << s.p50_ms << ", \"p90_ms\": " << s.p90_ms << ", \"p99_ms\": " << s.p99_ms << ", \"max_ms\": " << s.max_ms
+        << ", \"span_seconds\": " << s.span_seconds << ", \"items_per_second\": " << s.items_per_second << ", \"bytes\": " << s.bytes
+        << ", \"bytes_per_second\": " << s.bytes_per_second;
+    return;
+  }
+
+  void writeCsv(std::ostream& out, const StageStatistics& s) {
+    out << s.count << "," << s.busy_seconds << "," << s.mean_ms << "," << s.p50_ms << "," << s.p90_ms << "," << s.p99_ms << ","
+        << s.max_ms << "," << s.span_seconds << "," << s.items_per_second << "," << s.bytes << "," << s.bytes_per_second;
+    return;
+  }
+}
+
+bool StageProfiler::saveReport(const std::string& filename) {
+  typedef std::vector<std::tuple<int64_t, int64_t, double> > Samples;
+  std::map<std::string, Samples> stage_samples;
+  std::map<std::string, std::map<int, Samples> > stage_thread_samples;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0, i_end = thread_buffers_.size(); i < i_end; ++ i) {
+      const ThreadBuffer* thread_buffer = thread_buffers_[i].get();
+      for (size_t j = 0, j_end = thread_buffer->samples.size(); j < j_end; ++ j) {
+        const Sample& sample = thread_buffer->samples[j];
+        std::tuple<int64_t, int64_t, double> entry(sample.start, sample.duration, sample.bytes);
+        stage_samples[sample.stage].push_back(entry);
+        stage_thread_samples[sample.stage][thread_buffer->thread_idx].push_back(entry);
+      }
+    }
+  }
+
+  std::ofstream fout(filename);
+  if (!fout.good())
+    return false;
+  fout.precision(10);
+
+  if (boost::filesystem::path(filename).extension().string() == ".csv") {
+    fout << "stage,thread,count,busy_seconds,mean_ms,p50_ms,p90_ms,p99_ms,max_ms,span_seconds,items_per_second,bytes,bytes_per_second\n";
+    for (std::map<std::string, Samples>::const_iterator it = stage_samples.begin(); it != stage_samples.end(); ++ it) {
+      fout << it->first << ",all,";
+      writeCsv(fout, computeStatistics(it->second));
+      fout << "\n";
+      const std::map<int, Samples>& thread_samples = stage_thread_samples[it->first];
+      for (std::map<int, Samples>::const_iterator jt = thread_samples.begin(); jt != thread_samples.end(); ++ jt) {
+        fout << it->first << "," << jt->first << ",";
+        writeCsv(fout, computeStatistics(jt->second));
+        fout << "\n";
+      }
+    }
+    return fout.good();
+  }
+
+  fout << "{\n  \"stages\": [";
+  for (std::map<std::string, Samples>::const_iterator it = stage_samples.begin(); it != stage_samples.end(); ++ it) {
+    fout << ((it == stage_samples.begin()) ? "\n" : ",\n") << "    {\"stage\": \"" << it->first << "\", ";
+    writeJson(fout, computeStatistics(it->second));
+    fout << ",\n      \"threads\": [";
+    const std::map<int, Samples>& thread_samples = stage_thread_samples[it->first];
+    for (std::map<int, Samples>::const_iterator jt = thread_samples.begin(); jt != thread_samples.end(); ++ jt) {
+      fout << ((jt == thread_samples.begin()) ? "\n" : ",\n") << "        {\"thread\": " << jt->first << ", ";
+      writeJson(fout, computeStatistics(jt->second));
+      fout << "}";
+    }
+    fout << "\n      ]}";
+  }
+  fout << "\n  ]\n}\n";
+
+  return fout.good();
+}
+
+bool StageProfiler::saveTrace(const std::string& filename) {
+  std::ofstream fout(filename);
+  if (!fout.good())
+    return false;
+
+  // Microseconds, down to nanoseconds.
+  fout.setf(std::ios::fixed);
+  fout.precision(3);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  fout << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  bool first = true;
+  for (size_t i = 0, i_end = thread_buffers_.size(); i < i_end; ++ i) {
+    const ThreadBuffer* thread_buffer = thread_buffers_[i].get();
+    fout << (first ? "\n" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << thread_buffer->thread_idx
+        << ", \"args\": {\"name\": \"Thread " << thread_buffer->thread_idx << "\"}}";
+    first = false;
+    for (size_t j = 0, j_end = thread_buffer->samples.size(); j < j_end; ++ j) {
+      const Sample& sample = thread_buffer->samples[j];
+      fout << ",\n{\"name\": \"" << sample.stage << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << thread_buffer->thread_idx
+          << ", \"ts\": " << sample.start/1e3 << ", \"dur\": " << sample.duration/1e3 << ", \"args\": {\"bytes\": " << sample.bytes << "}}";
+    }
+  }
+  fout << "\n]}\n";
+
+  return fout.good();
+}
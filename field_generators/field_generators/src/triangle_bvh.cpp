@@ -0,0 +1,337 @@
+#define _USE_MATH_DEFINES
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include <Eigen/Geometry>
+
+#include "triangle_bvh.h"
+
+TriangleBVH::TriangleBVH(void) {
+}
+
+TriangleBVH::~TriangleBVH(void) {
+}
+
+void TriangleBVH::build(const std::vector<Eigen::Vector3f>& vertices, const std::vector<Eigen::Vector3i>& triangles) {
+  vertices_ = vertices;
+  triangles_ = triangles;
+  nodes_.clear();
+  triangle_indices_.resize(triangles_.size());
+  if (triangles_.empty())
+    return;
+
+  std::vector<Eigen::Vector3f> centroids(triangles_.size());
+  for (size_t i = 0, i_end = triangles_.size(); i < i_end; ++i) {
+    const Eigen::Vector3i& t = triangles_[i];
+    centroids[i] = (vertices_[t[0]] + vertices_[t[1]] + vertices_[t[2]]) / 3.0f;
+    triangle_indices_[i] = i;
+  }
+
+  nodes_.reserve(2 * triangles_.size() / leaf_size_ + 1);
+  buildNode(0, triangles_.size(), centroids);
+
+  return;
+}
+
+int TriangleBVH::buildNode(int start, int end, std::vector<Eigen::Vector3f>& centroids) {
+  Eigen::Vector3f min = Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+  Eigen::Vector3f max = Eigen::Vector3f::Constant(std::numeric_limits<float>::lowest());
+  Eigen::Vector3f centroid_min = min, centroid_max = max;
+  for (int i = start; i < end; ++i) {
+    const Eigen::Vector3i& t = triangles_[triangle_indices_[i]];
+    for (int j = 0; j < 3; ++j) {
+      min = min.cwiseMin(vertices_[t[j]]);
+      max = max.cwiseMax(vertices_[t[j]]);
+    }
+    centroid_min = centroid_min.cwiseMin(centroids[triangle_indices_[i]]);
+    centroid_max = centroid_max.cwiseMax(centroids[triangle_indices_[i]]);
+  }
+  Eigen::Vector3f normal = Eigen::Vector3f::Zero();
+  Eigen::Vector3f center = Eigen::Vector3f::Zero();
+  float area = 0.0f;
+  for (int i = start; i < end; ++i) {
+    const Eigen::Vector3i& t = triangles_[triangle_indices_[i]];
+    Eigen::Vector3f area_normal = 0.5f * (vertices_[t[1]] - vertices_[t[0]]).cross(vertices_[t[2]] - vertices_[t[0]]);
+    float triangle_area = area_normal.norm();
+    normal += area_normal;
+    center += triangle_area * centroids[triangle_indices_[i]];
+    area += triangle_area;
+  }
+  center = (area > 0.0f) ? Eigen::Vector3f(center / area) : Eigen::Vector3f((min + max) / 2);
+  float radius_squared = 0.0f;
+  for (int i = start; i < end; ++i) {
+    const Eigen::Vector3i& t = triangles_[triangle_indices_[i]];
+    for (int j = 0; j < 3; ++j)
+      radius_squared = std::max(radius_squared, (vertices_[t[j]] - center).squaredNorm());
+  }
+
+  Node node;
+  node.min = min;
+  node.max = max;
+  node.start = start;
+  node.count = end - start;
+  node.left = -1;
+  node.right = -1;
+  node.center = center;
+  node.normal = normal;
+  node.radius = std::sqrt(radius_squared);
+  int node_idx = nodes_.size();
+  nodes_.push_back(node);
+
+  if (end - start <= leaf_size_)
+    return node_idx;
+
+  int axis = 0;
+  Eigen::Vector3f extent = centroid_max - centroid_min;
+  if (extent[1] > extent[axis])
+    axis = 1;
+  if (extent[2] > extent[axis])
+    axis = 2;
+
+  int mid = (start + end) / 2;
+  std::nth_element(triangle_indices_.begin() + start, triangle_indices_.begin() + mid, triangle_indices_.begin() + end,
+      [&centroids, axis](int a, int b) {return centroids[a][axis] < centroids[b][axis];});
+
+  int left = buildNode(start, mid, centroids);
+  int right = buildNode(mid, end, centroids);
+  nodes_[node_idx].left = left;
+  nodes_[node_idx].right = right;
+
+  return node_idx;
+}
+
+float TriangleBVH::boxDistanceSquared(const Node& node, const Eigen::Vector3f& p) {
+  Eigen::Vector3f d = (node.min - p).cwiseMax(p - node.max).cwiseMax(Eigen::Vector3f::Zero());
+  return d.squaredNorm();
+}
+
+float TriangleBVH::boxEntry(const Node& node, const Eigen::Vector3f& origin, const Eigen::Vector3f& inverse_direction, float t_min,
+    float t_max) {
+  for (int i = 0; i < 3; ++i) {
+    float t_0 = (node.min[i] - origin[i]) * inverse_direction[i];
+    float t_1 = (node.max[i] - origin[i]) * inverse_direction[i];
+    if (t_0 > t_1)
+      std::swap(t_0, t_1);
+    // NaN, from a zero direction component on a slab boundary, leaves the bounds as they are.
+    t_min = (t_0 > t_min) ? t_0 : t_min;
+    t_max = (t_1 < t_max) ? t_1 : t_max;
+    if (t_min > t_max)
+      return std::numeric_limits<float>::infinity();
+  }
+  return t_min;
+}
+
+// Van Oosterom and Strackee, The solid angle of a plane triangle, 1983.
+float TriangleBVH::solidAngle(const Eigen::Vector3f& query, const Eigen::Vector3f& a, const Eigen::Vector3f& b, const Eigen::Vector3f& c) {
+  Eigen::Vector3f qa = a - query;
+  Eigen::Vector3f qb = b - query;
+  Eigen::Vector3f qc = c - query;
+  float la = qa.norm(), lb = qb.norm(), lc = qc.norm();
+  float numerator = qa.dot(qb.cross(qc));
+  float denominator = la * lb * lc + qa.dot(qb) * lc + qb.dot(qc) * la + qc.dot(qa) * lb;
+  return 2.0f * std::atan2(numerator, denominator);
+}
+
+float TriangleBVH::windingNumber(const Eigen::Vector3f& query, float beta) const {
+  if (nodes_.empty())
+    return 0.0f;
+
+  double sum = 0.0;
+  int stack[64];
+  int stack_size = 0;
+  stack[stack_size++] = 0;
+  while (stack_size != 0) {
+    const Node& node = nodes_[stack[--stack_size]];
+
+    Eigen::Vector3f offset = node.center - query;
+    float distance = offset.norm();
+    if (distance > beta * node.radius) {
+      sum += offset.dot(node.normal) / (distance * distance * distance);
+      continue;
+    }
+
+    if (node.isLeaf()) {
+      for (int i = node.start, i_end = node.start + node.count; i < i_end; ++i) {
+        const Eigen::Vector3i& t = triangles_[triangle_indices_[i]];
+        sum += solidAngle(query, vertices_[t[0]], vertices_[t[1]], vertices_[t[2]]);
+      }
+      continue;
+    }
+
+    stack[stack_size++] = node.left;
+    stack[stack_size++] = node.right;
+  }
+
+  return float(sum / (4.0 * M_PI));
+}
+
+// Ericson, Real-Time Collision Detection, 5.1.5.
+Eigen::Vector3f TriangleBVH::closestPointOnTriangle(const Eigen::Vector3f& p, const Eigen::Vector3f& a, const Eigen::Vector3f& b,
+    const Eigen::Vector3f& c) {
+  Eigen::Vector3f ab = b - a;
+  Eigen::Vector3f ac = c - a;
+  Eigen::Vector3f ap = p - a;
+  float d1 = ab.dot(ap);
+  float d2 = ac.dot(ap);
+  if (d1 <= 0.0f && d2 <= 0.0f)
+    return a;
+
+  Eigen::Vector3f bp = p - b;
+  float d3 = ab.dot(bp);
+  float d4 = ac.dot(bp);
+  if (d3 >= 0.0f && d4 <= d3)
+    return b;
+
+  float vc = d1 * d4 - d3 * d2;
+  if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+    return a + ab * (d1 / (d1 - d3));
+
+  Eigen::Vector3f cp = p - c;
+  float d5 = ab.dot(cp);
+  float d6 = ac.dot(cp);
+  if (d6 >= 0.0f && d5 <= d6)
+    return c;
+
+  float vb = d5 * d2 - d1 * d6;
+  if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+    return a + ac * (d2 / (d2 - d6));
+
+  float va = d3 * d6 - d5 * d4;
+  if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+    return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+  float denom = va + vb + vc;
+  if (denom == 0.0f) {
+    // Degenerate triangle, fall back to the closest vertex.
+    float da = ap.squaredNorm(), db = bp.squaredNorm(), dc = cp.squaredNorm();
+    return (da <= db && da <= dc) ? a : ((db <= dc) ? b : c);
+  }
+  float v = vb / denom;
+  float w = vc / denom;
+  return a + ab * v + ac * w;
+}
+
+float TriangleBVH::closestPoint(const Eigen::Vector3f& query, float max_distance_squared, int& triangle, Eigen::Vector3f& closest) const {
+  float best = max_distance_squared;
+  int best_triangle = -1;
+
+  if (triangle >= 0 && triangle < int(triangles_.size())) {
+    const Eigen::Vector3i& t = triangles_[triangle];
+    Eigen::Vector3f point = closestPointOnTriangle(query, vertices_[t[0]], vertices_[t[1]], vertices_[t[2]]);
+    float distance_squared = (point - query).squaredNorm();
+    if (distance_squared <= best) {
+      best = distance_squared;
+      best_triangle = triangle;
+      closest = point;
+    }
+  }
+
+  if (nodes_.empty()) {
+    triangle = best_triangle;
+    return best;
+  }
+
+  int stack[64];
+  int stack_size = 0;
+  stack[stack_size++] = 0;
+  while (stack_size != 0) {
+    const Node& node = nodes_[stack[--stack_size]];
+    if (boxDistanceSquared(node, query) > best)
+      continue;
+
+    if (node.isLeaf()) {
+      for (int i = node.start, i_end = node.start + node.count; i < i_end; ++i) {
+        int idx = triangle_indices_[i];
+        const Eigen::Vector3i& t = triangles_[idx];
+        Eigen::Vector3f point = closestPointOnTriangle(query, vertices_[t[0]], vertices_[t[1]], vertices_[t[2]]);
+        float distance_squared = (point - query).squaredNorm();
+        if (distance_squared < best || (distance_squared == best && best_triangle < 0)) {
+          best = distance_squared;
+          best_triangle = idx;
+          closest = point;
+        }
+      }
+      continue;
+    }
+
+    // Visit the nearer child first, i.e. push it last.
+    float left_distance = boxDistanceSquared(nodes_[node.left], query);
+    float right_distance = boxDistanceSquared(nodes_[node.right], query);
+    if (left_distance < right_distance) {
+      stack[stack_size++] = node.right;
+      stack[stack_size++] = node.left;
+    } else {
+      stack[stack_size++] = node.left;
+      stack[stack_size++] = node.right;
+    }
+  }
+
+  triangle = best_triangle;
+  return best;
+}
+
+// Moller and Trumbore, Fast, minimum storage ray/triangle intersection, 1997.
+int TriangleBVH::intersectRay(const Eigen::Vector3f& origin, const Eigen::Vector3f& direction, float t_min, float t_max, float& t) const {
+  int best_triangle = -1;
+  if (nodes_.empty())
+    return best_triangle;
+
+  Eigen::Vector3f inverse_direction = direction.cwiseInverse();
+  float best = t_max;
+
+  int stack[64];
+  int stack_size = 0;
+  stack[stack_size++] = 0;
+  while (stack_size != 0) {
+    const Node& node = nodes_[stack[--stack_size]];
+    if (boxEntry(node, origin, inverse_direction, t_min, best) > best)
+      continue;
+
+    if (node.isLeaf()) {
+      for (int i = node.start, i_end = node.start + node.count; i < i_end; ++i) {
+        int idx = triangle_indices_[i];
+        const Eigen::Vector3i& triangle = triangles_[idx];
+        const Eigen::Vector3f& a = vertices_[triangle[0]];
+        Eigen::Vector3f ab = vertices_[triangle[1]] - a;
+        Eigen::Vector3f ac = vertices_[triangle[2]] - a;
+        Eigen::Vector3f p = direction.cross(ac);
+        float determinant = ab.dot(p);
+        if (determinant == 0.0f)
+          continue;
+        float inverse_determinant = 1.0f / determinant;
+        Eigen::Vector3f ao = origin - a;
+        float u = ao.dot(p) * inverse_determinant;
+        if (u < 0.0f || u > 1.0f)
+          continue;
+        Eigen::Vector3f q = ao.cross(ab);
+        float v = direction.dot(q) * inverse_determinant;
+        if (v < 0.0f || u + v > 1.0f)
+          continue;
+        float t_hit = ac.dot(q) * inverse_determinant;
+        if (t_hit < t_min || t_hit > best || (t_hit == best && best_triangle >= 0))
+          continue;
+        best = t_hit;
+        best_triangle = idx;
+      }
+      continue;
+    }
+
+    // Visit the child the ray enters first first, i.e. push it last.
+    float left_entry = boxEntry(nodes_[node.left], origin, inverse_direction, t_min, best);
+    float right_entry = boxEntry(nodes_[node.right], origin, inverse_direction, t_min, best);
+    if (left_entry < right_entry) {
+      if (right_entry <= best)
+        stack[stack_size++] = node.right;
+      stack[stack_size++] = node.left;
+    } else {
+      if (left_entry <= best)
+        stack[stack_size++] = node.left;
+      if (right_entry <= best)
+        stack[stack_size++] = node.right;
+    }
+  }
+
+  t = best;
+  return best_triangle;
+}
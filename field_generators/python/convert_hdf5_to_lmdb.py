@@ -4,6 +4,7 @@
 import os
 import sys
 import h5py
+import numpy as np
 import lmdb
 import datetime
 import argparse
@@ -14,14 +15,18 @@ import matplotlib
 matplotlib.use('Agg')
 
 parser = argparse.ArgumentParser(description="Convert distance fields in .h5 format to lmdb.")
-parser.add_argument('-i', '--filelist', help='Path to input mesh model filelist', required=True)
-parser.add_argument('-d', '--df_list', help='Path to input distance field filelist', required=True)
+parser.add_argument('-i', '--filelist', help='Path to input mesh model filelist')
+parser.add_argument('-d', '--df_list', help='Path to input distance field filelist')
+parser.add_argument('-a', '--archive', help='Path to input distance field archive, instead of filelist and df_list')
 parser.add_argument('-o', '--lmdb_folder', help='Ouput LMDB folder', required=True)
 parser.add_argument('-c', '--caffe_path', help='Path to Caffe installation', required=True)
 parser.add_argument('-p', '--pool_size', help='Pool size', type=int, default=12)
 parser.add_argument('-f', '--save_float', help='Save data as float or not', action='store_true')
 parser.add_argument('-t', '--txn_batch', help='LMDB transaction batch size', type=int, default=1024)
+parser.add_argument('-n', '--normal_field', help='Convert the NormalField dataset (R*R*R*3, saved as float) instead of the DenseField one', action='store_true')
+parser.add_argument('-x', '--resolution', help='Pyramid level to convert, 0 for the primary (finest) one', type=int, default=0)
 args = parser.parse_args()
+assert args.archive or (args.filelist and args.df_list)
 
 if args.caffe_path:
   sys.path.append(os.path.join(args.caffe_path, 'python'))
@@ -35,23 +40,44 @@ pool = Pool(args.pool_size)
 env = lmdb.open(args.lmdb_folder, map_size=int(1e12))
 
 sample_idx = 0
-filenames = [line.strip().split()[-1] for line in open(args.df_list, 'r')]
-labels = [int(line.strip().split()[-1]) for line in open(args.filelist, 'r')]
+if args.archive:
+  # Packed by the generator, with the index in Names and Labels.
+  archive = h5py.File(args.archive, 'r')
+  filenames = list(archive['Names'][...])
+  labels = [int(label) for label in archive['Labels'][...]]
+else:
+  filenames = [line.strip().split()[-1] for line in open(args.df_list, 'r')]
+  labels = [int(line.strip().split()[-1]) for line in open(args.filelist, 'r')]
 assert len(filenames) == len(labels)
 datums = []
 for idx, filename in enumerate(filenames):
   print datetime.datetime.now().time(), 'Converting data %d (%s) of %d...'%(idx, filename, len(filenames))
-  hdf5_file = h5py.File(filename, 'r')
-  data = hdf5_file['DenseField']
+  if args.archive:
+    hdf5_file, row = archive, idx
+  else:
+    hdf5_file, row = h5py.File(filename, 'r'), Ellipsis
+  dataset = 'NormalField' if args.normal_field else 'DenseField'
+  suffix = '' if args.resolution == 0 else '_%d'%args.resolution
+  data = hdf5_file[dataset+suffix]
   label = labels[idx]
   print filename, label
-  array_float = data[:, :, :]
+  array = data[row]
   datum = caffe_pb2.Datum()
-  datum.channels, datum.height, datum.width = array_float.shape
-  if args.save_float:
-    datum.float_data.extend(array_float.astype(dtype='float').flat) 
+  # Normals are interleaved into the width, reshape to (0, 0, 0, -1, 3) to recover them.
+  datum.channels, datum.height, datum.width = array.shape[0], array.shape[1], array[0, 0].size
+  if array.dtype == np.uint8:
+    # Quantized by the generator, Meta[4] and Meta[5] hold the scale and offset back
+    # to voxels; the codes are voxels already only if those are 1 and 0.
+    meta = hdf5_file['Meta'+suffix][row]
+    if meta[4] != 1 or meta[5] != 0:
+      array = array*meta[4]+meta[5]
+  if array.dtype == np.uint8 and not args.save_float:
+    datum.data = array.tostring()
+  elif args.save_float or args.normal_field:
+    datum.float_data.extend(array.astype(dtype='float').flat)
   else:
-    array_uint8 = array_float.astype(dtype='uint8')
+    # Distances in voxels, floored and clamped rather than wrapped around.
+    array_uint8 = np.clip(array, 0, 255).astype(dtype='uint8')
     datum.data = array_uint8.tostring()
   datum.label = label
   datums.append(datum)
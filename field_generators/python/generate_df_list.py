@@ -8,19 +8,23 @@ parser = argparse.ArgumentParser(description="Generate distance field list.")
 parser.add_argument('-r', '--root_folder', help='Path to input root folder', required=True)
 parser.add_argument('-f', '--filelist', help='Path to input filelist', required=True)
 parser.add_argument('-o', '--output_folder', help='Path to output folder', required=True)
-parser.add_argument('-x', '--resolution', help='Distance field resolution', required=True)
+parser.add_argument('-x', '--resolution', help='Distance field resolution, or comma separated resolutions for a pyramid in one file', required=True)
 args = parser.parse_args()
 
+resolutions = sorted(set([int(r) for r in args.resolution.split(',')]), reverse=True)
+resolution = ','.join([str(r) for r in resolutions])
+resolution_tag = '_'.join([str(r) for r in resolutions])
+
 if not os.path.exists(args.output_folder):
   os.makedirs(args.output_folder)
 
 filelist = [line.split(' ')[0] for line in open(args.filelist, 'r')]
-filename_df_list = os.path.split(args.filelist)[-1].replace('filelist', 'df_'+str(args.resolution)+'_list')
+filename_df_list = os.path.split(args.filelist)[-1].replace('filelist', 'df_'+resolution_tag+'_list')
 with open(os.path.join(args.output_folder, filename_df_list), 'w') as file_df_list:
   for item in filelist:
     filename_source = os.path.join(args.root_folder, item)
     if '.off' in item:
-      filename_target = os.path.join(args.output_folder, "hdf5_"+str(args.resolution), item.replace('.off', '.h5'))
+      filename_target = os.path.join(args.output_folder, "hdf5_"+resolution_tag, item.replace('.off', '.h5'))
     elif '.obj' in item:
-      filename_target = os.path.join(args.output_folder, "hdf5_"+str(args.resolution), item.replace('.obj', '.h5'))
-    file_df_list.write(filename_source + ' ' + str(args.resolution) + ' ' + filename_target + '\n')
+      filename_target = os.path.join(args.output_folder, "hdf5_"+resolution_tag, item.replace('.obj', '.h5'))
+    file_df_list.write(filename_source + ' ' + resolution + ' ' + filename_target + '\n')